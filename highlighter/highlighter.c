@@ -0,0 +1,1054 @@
+//
+// Reference SDSLH highlighter - reads requests on stdin and writes replies on stdout.
+//
+// Requests are parsed by a state machine straight out of a fixed ring buffer: request and header lines are
+// gathered into a fixed line buffer, and bodies are handed on as pointers into the ring, so nothing is
+// allocated per message however many arrive or however big their bodies are.
+//
+// One process serves any number of documents, each named by its resource. Edits are applied on the input
+// thread as they arrive, and HIGHLIGHT requests are queued for a pool of worker threads, which take the
+// visible rows of the most recently active document first.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#define SDSLH_VERSION "SDSLH/1.0"
+#define RING_SIZE (1 << 16) // Input ring buffer - must be a power of two
+#define MAX_LINE 4096 // Request and header lines longer than this are cut short
+#define OUTPUT_BUFFER (1 << 16)
+#define LINE_MIN_CAP 16
+#define SPANS_TYPE "application/x-sdslh-spans" // Binary HIGHLIGHT bodies, if INIT says the editor accepts them
+#define CLASSES "bcksnove" // Class letters of text/plain bodies, in the order of span class numbers
+#define MAX_JOBS 256 // HIGHLIGHT and PING requests waiting for a worker - reading stops while the queue is full
+#define MAX_WORKERS 64
+
+// Lexer states carried from the end of one line into the start of the next
+#define LEX_NORMAL 0
+#define LEX_STRING 1 // Inside a "string", which may carry on over several lines
+#define LEX_COMMENT 2 // Inside a /* block comment */
+
+// Commands
+#define CMD_UNKNOWN 0
+#define CMD_INIT 1
+#define CMD_DELTA 2
+#define CMD_HIGHLIGHT 3
+#define CMD_PING 4
+#define CMD_ERROR 5
+#define CMD_CLOSE 6
+
+// Parser states
+#define PARSE_REQUEST 0 // Waiting for a request line
+#define PARSE_HEADERS 1
+#define PARSE_BODY 2
+
+// Input ring buffer - head and tail only ever increase and are masked to index data
+typedef struct {
+    char data[RING_SIZE];
+    size_t head; // Next byte to parse
+    size_t tail; // Next byte to fill
+} Ring;
+
+// The message being parsed
+typedef struct {
+    int state;
+    char line[MAX_LINE]; // The request or header line being gathered - it may wrap round the ring
+    size_t line_len;
+    int command;
+    char command_name[16];
+    char resource[PATH_MAX];
+    char range[128];
+    char timestamp[32];
+    char visible[128];
+    size_t body_left;
+    int failed; // An ERROR has been sent for this message, ignore the rest of it
+    int accept_spans; // Accept lists SPANS_TYPE
+    struct Document *held; // The document an INIT or DELTA is being applied to, kept from the workers
+} Parser;
+
+typedef struct {
+    char *chars;
+    int len;
+    int cap;
+    unsigned char state; // Lexer state at the end of the line - only current for lines before Document.valid
+} Line;
+
+// A document's lines are kept in a treap - a binary tree in line order, kept balanced by giving each node a
+// random priority above its children's - and each node counts the lines and characters under it. Finding a
+// line by number or by absolute offset, inserting lines and deleting them all take O(log n) time however
+// big the document is. The nodes live in one array and link by index, so growing it leaves links alone.
+typedef struct {
+    Line line;
+    int left; // 0 for none
+    int right;
+    unsigned priority;
+    int count; // Lines in the subtree
+    long chars; // Their total length, newlines included
+} LineNode;
+
+// The lines are only touched by whichever thread has the document busy, or by the input thread while no
+// worker has it. The rest is the input thread's, apart from what is kept under pool.lock.
+typedef struct Document {
+    char resource[PATH_MAX];
+    LineNode *nodes; // nodes[0] stands for no node, so it is always empty and counts nothing
+    int num_nodes;
+    int nodes_cap;
+    int free_nodes; // Released nodes, linked through left
+    int root;
+    int num_lines;
+    unsigned seed; // For node priorities
+    int valid; // Lines before this have an up to date end state
+    int spans; // Reply with SPANS_TYPE bodies rather than text/plain
+    int insert_y; // Where the body of the INIT or DELTA being parsed goes
+    int insert_x;
+    // Kept under pool.lock
+    char timestamp[32]; // The newest INIT, DELTA, HIGHLIGHT or PING Timestamp, a version the lines are at
+    int busy; // A worker is highlighting it, or the input thread is applying an edit
+    int jobs; // Queued or running
+    int visible_y0; // The rows the editor last said it shows, -1 until it says
+    int visible_y1;
+    long active; // When anything last arrived for it, in messages
+} Document;
+
+// A queued HIGHLIGHT or PING request
+typedef struct {
+    Document *doc;
+    int ping; // ACK once the document's earlier jobs are answered, rather than highlight
+    char range[128];
+    char timestamp[32]; // The document's, once a worker takes it
+    int y0; // The rows of a line:column range, for priorities - -1 for an absolute one
+    int y1;
+    long seq; // Arrival order
+} Job;
+
+// Per thread scratch, reused for every reply
+typedef struct {
+    char *classes; // One line of class letters
+    int classes_cap;
+    char *encoded; // The body of a reply, SPANS_TYPE or a letter per character
+    size_t encoded_len;
+    size_t encoded_cap;
+} Scratch;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // A job queued or finished, or a document released
+    Job jobs[MAX_JOBS]; // In no order - seq keeps it
+    int num_jobs;
+    long seq;
+    long messages;
+    int quit; // No more jobs are coming - finish those queued and stop
+    pthread_t threads[MAX_WORKERS];
+    Scratch scratch[MAX_WORKERS];
+    int num_threads; // 0 to highlight on the input thread
+} Pool;
+
+const char *KEYWORDS[] = {"if", "else", "while", "for", "do", "return", "function", "var", "let", "const",
+                          "true", "false", "null", "and", "or", "not", NULL};
+
+// Every document named by an INIT and not yet closed, looked up by resource
+Document **documents;
+int num_documents;
+int documents_cap;
+
+Pool pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER};
+
+// The input thread's scratch, for highlighting without workers
+Scratch input_scratch;
+
+// Reads whatever is available into the free space of the ring - up to two pieces, either side of the wrap
+ssize_t ring_fill(Ring *ring, int fd) {
+    size_t space = RING_SIZE - (ring->tail - ring->head);
+    size_t start = ring->tail & (RING_SIZE - 1);
+    size_t first = RING_SIZE - start < space ? RING_SIZE - start : space;
+    struct iovec iov[2] = {{ring->data + start, first}, {ring->data, space - first}};
+    ssize_t n = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+    if (n > 0) ring->tail += n;
+    return n;
+}
+
+// The unparsed bytes that are contiguous in memory - everything up to the wrap at most
+char *ring_peek(Ring *ring, size_t *len) {
+    size_t start = ring->head & (RING_SIZE - 1);
+    size_t avail = ring->tail - ring->head;
+    *len = RING_SIZE - start < avail ? RING_SIZE - start : avail;
+    return ring->data + start;
+}
+
+// Write the request line and headers of a reply - the body, if any, follows. Replies are written from
+// several threads, so the whole of one is written with stdout locked.
+void reply_headers(const char *resource, const char *command, const char *timestamp, const char *extra_headers,
+                   size_t body_len) {
+    printf("%s %s " SDSLH_VERSION "\n", command, resource[0] ? resource : "/");
+    if (timestamp[0]) printf("Timestamp: %s\n", timestamp);
+    fputs(extra_headers, stdout);
+    if (body_len) printf("Content-Length: %zu\n", body_len);
+    putchar('\n');
+}
+
+void reply(const char *resource, const char *command, const char *timestamp, const char *extra_headers,
+           const char *body, size_t body_len) {
+    flockfile(stdout);
+    reply_headers(resource, command, timestamp, extra_headers, body_len);
+    fwrite(body, 1, body_len, stdout);
+    funlockfile(stdout);
+}
+
+void reply_error(Parser *p, const char *message) {
+    reply(p->resource, "ERROR", p->timestamp, "Content-Type: text/plain\n", message, strlen(message));
+    p->failed = 1;
+}
+
+void line_reserve(Line *line, int n) {
+    if (line->cap - line->len >= n) return;
+    int cap = line->cap * 2;
+    if (cap < line->len + n) cap = line->len + n;
+    if (cap < LINE_MIN_CAP) cap = LINE_MIN_CAP;
+    line->chars = realloc(line->chars, cap);
+    line->cap = cap;
+}
+
+void line_insert(Line *line, int x, const char *chars, int n) {
+    line_reserve(line, n);
+    memmove(line->chars + x + n, line->chars + x, line->len - x);
+    memcpy(line->chars + x, chars, n);
+    line->len += n;
+}
+
+// Bring a node's counts up to date with its children's
+void node_update(Document *doc, int n) {
+    LineNode *node = &doc->nodes[n];
+    node->count = 1 + doc->nodes[node->left].count + doc->nodes[node->right].count;
+    node->chars = node->line.len + 1 + doc->nodes[node->left].chars + doc->nodes[node->right].chars;
+}
+
+// A node for an empty line, on its own
+int node_new(Document *doc) {
+    int n = doc->free_nodes;
+    if (n) {
+        doc->free_nodes = doc->nodes[n].left;
+    } else {
+        if (doc->num_nodes == doc->nodes_cap) {
+            doc->nodes_cap = doc->nodes_cap * 2 + 64;
+            doc->nodes = realloc(doc->nodes, sizeof(LineNode) * doc->nodes_cap);
+            if (!doc->num_nodes) doc->nodes[doc->num_nodes++] = (LineNode){0};
+        }
+        n = doc->num_nodes++;
+    }
+    // xorshift32
+    doc->seed ^= doc->seed << 13;
+    doc->seed ^= doc->seed >> 17;
+    doc->seed ^= doc->seed << 5;
+    doc->nodes[n] = (LineNode){.priority = doc->seed, .count = 1, .chars = 1};
+    return n;
+}
+
+// Free the lines of a subtree and give its nodes back
+void node_free(Document *doc, int n) {
+    if (!n) return;
+    node_free(doc, doc->nodes[n].left);
+    node_free(doc, doc->nodes[n].right);
+    free(doc->nodes[n].line.chars);
+    doc->nodes[n].left = doc->free_nodes;
+    doc->free_nodes = n;
+}
+
+// Join two subtrees, the lines of a before those of b
+int node_merge(Document *doc, int a, int b) {
+    if (!a || !b) return a ? a : b;
+    if (doc->nodes[a].priority > doc->nodes[b].priority) {
+        doc->nodes[a].right = node_merge(doc, doc->nodes[a].right, b);
+        node_update(doc, a);
+        return a;
+    }
+    doc->nodes[b].left = node_merge(doc, a, doc->nodes[b].left);
+    node_update(doc, b);
+    return b;
+}
+
+// Split a subtree into its first k lines, in a, and the rest, in b
+void node_split(Document *doc, int n, int k, int *a, int *b) {
+    if (!n) {
+        *a = *b = 0;
+        return;
+    }
+    LineNode *node = &doc->nodes[n];
+    int left = doc->nodes[node->left].count;
+    if (k <= left) {
+        node_split(doc, node->left, k, a, &node->left);
+        *b = n;
+    } else {
+        node_split(doc, node->right, k - left - 1, &node->right, b);
+        *a = n;
+    }
+    node_update(doc, n);
+}
+
+// Line y, which has to be in the document. Good until lines are next inserted.
+Line *doc_line(Document *doc, int y) {
+    int n = doc->root;
+    while (1) {
+        LineNode *node = &doc->nodes[n];
+        int left = doc->nodes[node->left].count;
+        if (y == left) return &node->line;
+        if (y < left) {
+            n = node->left;
+        } else {
+            y -= left + 1;
+            n = node->right;
+        }
+    }
+}
+
+// Line y has grown by delta characters (or shrunk, if it is negative) - every node above it counts them
+void doc_line_resized(Document *doc, int y, long delta) {
+    int n = doc->root;
+    while (1) {
+        LineNode *node = &doc->nodes[n];
+        node->chars += delta;
+        int left = doc->nodes[node->left].count;
+        if (y == left) return;
+        if (y < left) {
+            n = node->left;
+        } else {
+            y -= left + 1;
+            n = node->right;
+        }
+    }
+}
+
+// The line an absolute offset falls in, and how far into it - the end of the last line if it is past that
+void doc_find_offset(Document *doc, long offset, int *y, int *x) {
+    int n = doc->root;
+    int before = 0;
+    while (n) {
+        LineNode *node = &doc->nodes[n];
+        long left = doc->nodes[node->left].chars;
+        if (offset < left) {
+            n = node->left;
+            continue;
+        }
+        offset -= left;
+        before += doc->nodes[node->left].count;
+        if (offset <= node->line.len) {
+            *y = before;
+            *x = (int)offset;
+            return;
+        }
+        offset -= node->line.len + 1;
+        before++;
+        n = node->right;
+    }
+    *y = doc->num_lines - 1;
+    *x = doc_line(doc, *y)->len;
+}
+
+// Splice the lines of a tree in at y, returning how many there were
+int doc_insert_tree(Document *doc, int y, int tree) {
+    int before, after, count = doc->nodes[tree].count;
+    node_split(doc, doc->root, y, &before, &after);
+    doc->root = node_merge(doc, node_merge(doc, before, tree), after);
+    doc->num_lines += count;
+    return count;
+}
+
+// Open up count empty lines at y
+void doc_insert_lines(Document *doc, int y, int count) {
+    int added = 0;
+    for (int i = 0; i < count; i++) added = node_merge(doc, added, node_new(doc));
+    doc_insert_tree(doc, y, added);
+}
+
+void doc_delete_lines(Document *doc, int y, int count) {
+    int before, rest, gone, after;
+    node_split(doc, doc->root, y, &before, &rest);
+    node_split(doc, rest, count, &gone, &after);
+    node_free(doc, gone);
+    doc->root = node_merge(doc, before, after);
+    doc->num_lines -= count;
+}
+
+void doc_invalidate(Document *doc, int y) {
+    if (y < doc->valid) doc->valid = y;
+}
+
+// Back to a single empty line
+void doc_reset(Document *doc) {
+    doc_delete_lines(doc, 0, doc->num_lines);
+    doc_insert_lines(doc, 0, 1);
+    doc->valid = 0;
+}
+
+Document *doc_find(const char *resource) {
+    for (int i = 0; i < num_documents; i++) {
+        if (strcmp(documents[i]->resource, resource) == 0) return documents[i];
+    }
+    return NULL;
+}
+
+Document *doc_open(const char *resource) {
+    if (num_documents == documents_cap) {
+        documents_cap = documents_cap ? documents_cap * 2 : 16;
+        documents = realloc(documents, sizeof(Document *) * documents_cap);
+    }
+    Document *doc = calloc(1, sizeof(Document));
+    snprintf(doc->resource, sizeof(doc->resource), "%s", resource);
+    doc->visible_y0 = doc->visible_y1 = -1;
+    doc->seed = 2463534242u;
+    documents[num_documents++] = doc;
+    return doc;
+}
+
+void doc_free(Document *doc) {
+    doc_delete_lines(doc, 0, doc->num_lines);
+    free(doc->nodes);
+    free(doc);
+}
+
+// Insert text at the insertion point, moving the insertion point past it. Bodies arrive in pieces,
+// so this is called for each piece in turn.
+void doc_insert(Document *doc, const char *text, size_t len) {
+    doc_invalidate(doc, doc->insert_y);
+    const char *end = text + len;
+    const char *nl = memchr(text, '\n', len);
+    int n = (int)((nl ? nl : end) - text);
+    Line *line = doc_line(doc, doc->insert_y);
+    line_insert(line, doc->insert_x, text, n);
+    doc_line_resized(doc, doc->insert_y, n);
+    doc->insert_x += n;
+    if (!nl) return;
+
+    // The new lines are built into a tree of their own and spliced in once, the last of them taking
+    // the rest of the line from the insertion point. The rest stays put in line's buffer until then.
+    int split_x = doc->insert_x, split_len = line->len;
+    const char *rest = line->chars + split_x;
+    int added = 0;
+    for (text = nl + 1; nl; text = nl + 1) {
+        nl = memchr(text, '\n', end - text);
+        n = (int)((nl ? nl : end) - text);
+        int m = node_new(doc);
+        Line *next = &doc->nodes[m].line;
+        line_insert(next, 0, text, n);
+        if (!nl) {
+            line_insert(next, n, rest, split_len - split_x);
+            doc->insert_x = n;
+        }
+        node_update(doc, m);
+        added = node_merge(doc, added, m);
+    }
+    doc_line(doc, doc->insert_y)->len = split_x;
+    doc_line_resized(doc, doc->insert_y, split_x - split_len);
+    doc->insert_y += doc_insert_tree(doc, doc->insert_y + 1, added);
+}
+
+// Delete from (y0, x0) up to (y1, x1)
+void doc_delete(Document *doc, int y0, int x0, int y1, int x1) {
+    doc_invalidate(doc, y0);
+    Line *first = doc_line(doc, y0);
+    Line *last = doc_line(doc, y1);
+    if (y0 == y1) {
+        memmove(first->chars + x0, first->chars + x1, first->len - x1);
+        first->len -= x1 - x0;
+        doc_line_resized(doc, y0, x0 - x1);
+        return;
+    }
+    doc_line_resized(doc, y0, x0 + last->len - x1 - first->len);
+    first->len = x0;
+    line_insert(first, x0, last->chars + x1, last->len - x1);
+    doc_delete_lines(doc, y0 + 1, y1 - y0);
+}
+
+// Parse a position - "line:column" or an absolute character offset - clamped to the document
+const char *parse_position(Document *doc, const char *s, int *y, int *x) {
+    char *end;
+    long a = strtol(s, &end, 10);
+    if (end == s || a < 0) return NULL;
+    if (*end == ':') {
+        s = end + 1;
+        long b = strtol(s, &end, 10);
+        if (end == s || b < 0) return NULL;
+        *y = a < doc->num_lines ? (int)a : doc->num_lines - 1;
+        int len = doc_line(doc, *y)->len;
+        *x = b < len && a < doc->num_lines ? (int)b : len;
+        return end;
+    }
+    // An absolute offset, counting a newline at the end of each line
+    doc_find_offset(doc, a, y, x);
+    return end;
+}
+
+int parse_range(Document *doc, const char *s, int *y0, int *x0, int *y1, int *x1) {
+    while (*s == ' ') s++;
+    s = parse_position(doc, s, y0, x0);
+    if (!s || *s != '-') return 0;
+    s = parse_position(doc, s + 1, y1, x1);
+    if (!s) return 0;
+    return *y0 < *y1 || (*y0 == *y1 && *x0 <= *x1);
+}
+
+// The rows a line:column range touches, unclamped, for working out priorities - 0 for any other range
+int range_rows(const char *s, int *y0, int *y1) {
+    int x1;
+    if (sscanf(s, "%d:%*d-%d:%d", y0, y1, &x1) != 3) return 0;
+    // Whole rows up to y1:0 do not include row y1
+    if (x1 == 0 && *y1 > *y0) (*y1)--;
+    return 1;
+}
+
+int is_keyword(const char *s, int len) {
+    for (const char **k = KEYWORDS; *k; k++) {
+        if ((int)strlen(*k) == len && memcmp(*k, s, len) == 0) return 1;
+    }
+    return 0;
+}
+
+// Highlight one line starting in the given state, writing a class letter for each character to out
+// (which may be NULL when only the end state is wanted). Returns the state at the end of the line.
+int lex_line(const char *s, int len, int state, char *out) {
+    int i = 0;
+    while (i < len) {
+        int start = i;
+        char class;
+        if (state == LEX_STRING) {
+            // Up to and including the closing quote
+            while (i < len && s[i] != '"') i += s[i] == '\\' ? 2 : 1;
+            if (i < len) {
+                i++;
+                state = LEX_NORMAL;
+            }
+            if (i > len) i = len;
+            class = 's';
+        } else if (state == LEX_COMMENT) {
+            // Up to and including the closing */
+            while (i < len && !(s[i] == '*' && i + 1 < len && s[i + 1] == '/')) i++;
+            if (i < len) {
+                i += 2;
+                state = LEX_NORMAL;
+            }
+            class = 'c';
+        } else if (s[i] == '/' && i + 1 < len && s[i + 1] == '*') {
+            i += 2;
+            state = LEX_COMMENT;
+            class = 'c';
+        } else if (s[i] == '#') {
+            i = len;
+            class = 'c';
+        } else if (s[i] == '"') {
+            i++;
+            state = LEX_STRING;
+            class = 's';
+        } else if (isdigit((unsigned char)s[i])) {
+            while (i < len && (isalnum((unsigned char)s[i]) || s[i] == '.')) i++;
+            class = 'n';
+        } else if (isalpha((unsigned char)s[i]) || s[i] == '_') {
+            while (i < len && (isalnum((unsigned char)s[i]) || s[i] == '_')) i++;
+            class = is_keyword(s + start, i - start) ? 'k' : 'v';
+        } else if (isspace((unsigned char)s[i])) {
+            i++;
+            class = 'b';
+        } else {
+            i++;
+            class = 'o';
+        }
+        if (out) memset(out + start, class, i - start);
+    }
+    return state;
+}
+
+// Bring the line end states up to date as far as line y (exclusive)
+void doc_lex_to(Document *doc, int y) {
+    int state = doc->valid > 0 ? doc_line(doc, doc->valid - 1)->state : LEX_NORMAL;
+    for (; doc->valid < y; doc->valid++) {
+        Line *line = doc_line(doc, doc->valid);
+        state = line->state = (unsigned char)lex_line(line->chars, line->len, state, NULL);
+    }
+}
+
+// Lex line y into the class letter scratch, whose lexer states must be up to date as far as y
+char *lex_doc_line(Document *doc, Scratch *s, int y) {
+    Line *line = doc_line(doc, y);
+    if (line->len > s->classes_cap) {
+        s->classes_cap = line->len * 2;
+        s->classes = realloc(s->classes, s->classes_cap);
+    }
+    int state = y > 0 ? doc_line(doc, y - 1)->state : LEX_NORMAL;
+    line->state = (unsigned char)lex_line(line->chars, line->len, state, s->classes);
+    if (y == doc->valid) doc->valid++;
+    return s->classes;
+}
+
+// Make room for n more bytes of body
+void encode_reserve(Scratch *s, size_t n) {
+    if (s->encoded_cap - s->encoded_len < n) {
+        s->encoded_cap = s->encoded_cap * 2 + n + 4096;
+        s->encoded = realloc(s->encoded, s->encoded_cap);
+    }
+}
+
+void encode_varint(Scratch *s, unsigned value) {
+    encode_reserve(s, 5);
+    while (value >= 0x80) {
+        s->encoded[s->encoded_len++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    s->encoded[s->encoded_len++] = (char)value;
+}
+
+// Add a line of class letters to the SPANS_TYPE body - length, gap since the last token and class number
+// for each run of one class other than body, then a length of 0
+void encode_line(Scratch *s, const char *letters, int len) {
+    int last = 0;
+    for (int i = 0; i < len;) {
+        int start = i;
+        while (i < len && letters[i] == letters[start]) i++;
+        if (letters[start] == 'b') continue;
+        encode_varint(s, i - start);
+        encode_varint(s, start - last);
+        encode_varint(s, (unsigned)(strchr(CLASSES, letters[start]) - CLASSES));
+        last = i;
+    }
+    encode_varint(s, 0);
+}
+
+// Reply with the classes of every line the range touches. The reply is written before the document is
+// released, so it always goes out ahead of the ACK of any later edit. Jobs may be answered out of order,
+// so the reply's Timestamp is the document's newest rather than the request's, which keeps the Timestamps
+// of replies for a document from ever going backwards.
+void reply_highlight(Document *doc, const Job *job, Scratch *s) {
+    int y0, x0, y1, x1;
+    if (!parse_range(doc, job->range, &y0, &x0, &y1, &x1)) {
+        const char *message = "Bad or missing Range";
+        reply(doc->resource, "ERROR", job->timestamp, "Content-Type: text/plain\n", message, strlen(message));
+        return;
+    }
+    // Whole rows up to y1:0 do not include row y1
+    if (x1 == 0 && y1 > y0) y1--;
+
+    // The body is built before stdout is locked, so other threads' replies are not held up by lexing
+    doc_lex_to(doc, y0);
+    s->encoded_len = 0;
+    for (int i = y0; i <= y1; i++) {
+        int len = doc_line(doc, i)->len;
+        const char *letters = lex_doc_line(doc, s, i);
+        if (doc->spans) {
+            encode_line(s, letters, len);
+        } else {
+            // One letter per character and a newline per line
+            encode_reserve(s, len + 1);
+            memcpy(s->encoded + s->encoded_len, letters, len);
+            s->encoded_len += len;
+            s->encoded[s->encoded_len++] = '\n';
+        }
+    }
+
+    char headers[256];
+    snprintf(headers, sizeof(headers), "Range: %d:0-%d:0\nContent-Type: %s\n", y0, y1 + 1,
+             doc->spans ? SPANS_TYPE : "text/plain");
+    flockfile(stdout);
+    reply_headers(doc->resource, "HIGHLIGHT", job->timestamp, headers, s->encoded_len);
+    fwrite(s->encoded, 1, s->encoded_len, stdout);
+    funlockfile(stdout);
+}
+
+// Whether a job is worth doing before another - rows the editor shows come first, then the most recently
+// active document, then whichever arrived first
+int job_before(const Job *a, const Job *b) {
+    int a_shown = a->y0 < 0 || a->doc->visible_y0 < 0 ||
+                  (a->y0 <= a->doc->visible_y1 && a->y1 >= a->doc->visible_y0);
+    int b_shown = b->y0 < 0 || b->doc->visible_y0 < 0 ||
+                  (b->y0 <= b->doc->visible_y1 && b->y1 >= b->doc->visible_y0);
+    if (a_shown != b_shown) return a_shown;
+    if (a->doc->active != b->doc->active) return a->doc->active > b->doc->active;
+    return a->seq < b->seq;
+}
+
+// Whether a job has to wait for another of its document's - a PING for every job before it, and every
+// job after a PING for the PING
+int job_blocked(const Job *job) {
+    for (int i = 0; i < pool.num_jobs; i++) {
+        const Job *other = &pool.jobs[i];
+        if (other->doc == job->doc && other->seq < job->seq && (job->ping || other->ping)) return 1;
+    }
+    return 0;
+}
+
+// The most pressing job whose document is free, or NULL - called with pool.lock held
+Job *job_pick(void) {
+    Job *best = NULL;
+    for (int i = 0; i < pool.num_jobs; i++) {
+        Job *job = &pool.jobs[i];
+        if (!job->doc->busy && (!best || job_before(job, best)) && !job_blocked(job)) best = job;
+    }
+    return best;
+}
+
+void *worker_main(void *arg) {
+    Scratch *scratch = arg;
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        Job *next = job_pick();
+        if (!next) {
+            if (pool.quit && !pool.num_jobs) break;
+            pthread_cond_wait(&pool.changed, &pool.lock);
+            continue;
+        }
+        Job job = *next;
+        *next = pool.jobs[--pool.num_jobs];
+        job.doc->busy = 1;
+        if (job.doc->timestamp[0]) memcpy(job.timestamp, job.doc->timestamp, sizeof(job.timestamp));
+        pthread_mutex_unlock(&pool.lock);
+
+        if (job.ping) {
+            reply(job.doc->resource, "ACK", job.timestamp, "", "", 0);
+        } else {
+            reply_highlight(job.doc, &job, scratch);
+        }
+        fflush(stdout);
+
+        pthread_mutex_lock(&pool.lock);
+        job.doc->busy = 0;
+        job.doc->jobs--;
+        pthread_cond_broadcast(&pool.changed);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+void pool_start(int threads) {
+    if (threads > MAX_WORKERS) threads = MAX_WORKERS;
+    for (pool.num_threads = 0; pool.num_threads < threads; pool.num_threads++) {
+        if (pthread_create(&pool.threads[pool.num_threads], NULL, worker_main,
+                           &pool.scratch[pool.num_threads]) != 0) break;
+    }
+}
+
+// Let the workers finish the jobs queued and wait for them
+void pool_stop(void) {
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.num_threads; i++) {
+        pthread_join(pool.threads[i], NULL);
+        free(pool.scratch[i].classes);
+        free(pool.scratch[i].encoded);
+    }
+}
+
+// Take the document from the workers, waiting for one highlighting it - and, if drain is set, until none
+// of its jobs are left. Called with pool.lock held.
+void doc_wait(Document *doc, int drain) {
+    while (doc->busy || (drain && doc->jobs)) pthread_cond_wait(&pool.changed, &pool.lock);
+}
+
+void doc_hold(Parser *p, Document *doc) {
+    pthread_mutex_lock(&pool.lock);
+    doc_wait(doc, 0);
+    doc->busy = 1;
+    pthread_mutex_unlock(&pool.lock);
+    p->held = doc;
+}
+
+// Give the document back to the workers once the INIT or DELTA is in
+void doc_release(Parser *p) {
+    if (!p->held) return;
+    pthread_mutex_lock(&pool.lock);
+    p->held->busy = 0;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+    p->held = NULL;
+}
+
+// The message's Timestamp says which version the document's lines are at
+void doc_timestamp(Parser *p, Document *doc) {
+    if (!p->timestamp[0]) return;
+    pthread_mutex_lock(&pool.lock);
+    memcpy(doc->timestamp, p->timestamp, sizeof(doc->timestamp));
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Add a job to the queue, waiting for room - called with pool.lock held
+void job_push(Job *job) {
+    while (pool.num_jobs == MAX_JOBS) pthread_cond_wait(&pool.changed, &pool.lock);
+    job->seq = pool.seq++;
+    pool.jobs[pool.num_jobs++] = *job;
+    job->doc->jobs++;
+    pthread_cond_broadcast(&pool.changed);
+}
+
+// Queue a HIGHLIGHT request, or answer it straight away if there are no workers
+void queue_highlight(Parser *p, Document *doc) {
+    Job job = {.doc = doc};
+    snprintf(job.range, sizeof(job.range), "%s", p->range);
+    snprintf(job.timestamp, sizeof(job.timestamp), "%s", p->timestamp);
+    if (!range_rows(job.range, &job.y0, &job.y1)) job.y0 = job.y1 = -1;
+    doc_timestamp(p, doc);
+    if (!pool.num_threads) {
+        reply_highlight(doc, &job, &input_scratch);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    // A request for rows already waiting is answered by the one already queued, unless a PING is queued
+    // between them
+    int found = 0;
+    for (int i = 0; i < pool.num_jobs; i++) {
+        if (pool.jobs[i].doc != doc) continue;
+        if (pool.jobs[i].ping) {
+            found = 0;
+            break;
+        }
+        if (strcmp(pool.jobs[i].range, job.range) == 0) found = 1;
+    }
+    if (!found) job_push(&job);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Queue the ACK of a PING behind every job already queued for the document, so it comes after their
+// replies without the input thread waiting for them. Like a HIGHLIGHT reply it carries the document's
+// newest Timestamp, in case an ACK for a later edit goes out first.
+void queue_ping(Parser *p, Document *doc) {
+    doc_timestamp(p, doc);
+    if (!pool.num_threads) {
+        reply(doc->resource, "ACK", p->timestamp, "", "", 0);
+        return;
+    }
+    Job job = {.doc = doc, .ping = 1, .y0 = -1, .y1 = -1};
+    snprintf(job.timestamp, sizeof(job.timestamp), "%s", p->timestamp);
+    pthread_mutex_lock(&pool.lock);
+    job_push(&job);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Forget a document, once everything queued for it has been answered
+void doc_close(Document *doc) {
+    pthread_mutex_lock(&pool.lock);
+    doc_wait(doc, 1);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < num_documents; i++) {
+        if (documents[i] == doc) documents[i] = documents[--num_documents];
+    }
+    doc_free(doc);
+}
+
+// Note which rows of the document the editor shows, and that it is the one being worked on
+void doc_touch(Parser *p, Document *doc) {
+    pthread_mutex_lock(&pool.lock);
+    doc->active = ++pool.messages;
+    int y0, y1;
+    if (p->visible[0] && range_rows(p->visible, &y0, &y1)) {
+        doc->visible_y0 = y0;
+        doc->visible_y1 = y1;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Called once the headers of a message have all arrived
+void message_start(Parser *p) {
+    if (p->failed) return;
+    if (p->command == CMD_UNKNOWN) {
+        char message[64];
+        snprintf(message, sizeof(message), "Unknown command %s", p->command_name);
+        reply_error(p, message);
+        return;
+    }
+    if (p->command == CMD_ERROR) return;
+    Document *doc = doc_find(p->resource);
+    if (p->command == CMD_INIT) {
+        if (!doc) doc = doc_open(p->resource);
+        doc_touch(p, doc);
+        doc_hold(p, doc);
+        doc_reset(doc);
+        doc->spans = p->accept_spans;
+        doc->insert_y = 0;
+        doc->insert_x = 0;
+        doc_timestamp(p, doc);
+        return;
+    }
+    if (!doc) {
+        reply_error(p, "Unknown resource - send INIT first");
+        return;
+    }
+    doc_touch(p, doc);
+    if (p->command == CMD_DELTA) {
+        doc_hold(p, doc);
+        int y0, x0, y1, x1;
+        if (!parse_range(doc, p->range, &y0, &x0, &y1, &x1)) {
+            doc_release(p);
+            reply_error(p, "Bad or missing Range");
+            return;
+        }
+        doc_delete(doc, y0, x0, y1, x1);
+        doc->insert_y = y0;
+        doc->insert_x = x0;
+        doc_timestamp(p, doc);
+    }
+}
+
+// A piece of the body, straight out of the ring
+void message_body(Parser *p, const char *data, size_t len) {
+    if (p->failed) return;
+    if (p->command == CMD_INIT || p->command == CMD_DELTA) doc_insert(p->held, data, len);
+}
+
+void message_end(Parser *p) {
+    doc_release(p);
+    if (p->failed) return;
+    switch (p->command) {
+        case CMD_INIT:
+        case CMD_DELTA:
+            reply(p->resource, "ACK", p->timestamp, "", "", 0);
+            break;
+        case CMD_PING:
+            // After every reply still to come for the document, so the ACK's Timestamp is the newest
+            queue_ping(p, doc_find(p->resource));
+            break;
+        case CMD_HIGHLIGHT:
+            queue_highlight(p, doc_find(p->resource));
+            break;
+        case CMD_CLOSE:
+            doc_close(doc_find(p->resource));
+            reply(p->resource, "ACK", p->timestamp, "", "", 0);
+            break;
+        default:
+            // An ERROR from the editor needs no reply
+            break;
+    }
+}
+
+int command_code(const char *name) {
+    if (strcmp(name, "INIT") == 0) return CMD_INIT;
+    if (strcmp(name, "DELTA") == 0) return CMD_DELTA;
+    if (strcmp(name, "HIGHLIGHT") == 0) return CMD_HIGHLIGHT;
+    if (strcmp(name, "PING") == 0) return CMD_PING;
+    if (strcmp(name, "ERROR") == 0) return CMD_ERROR;
+    if (strcmp(name, "CLOSE") == 0) return CMD_CLOSE;
+    return CMD_UNKNOWN;
+}
+
+// A complete request or header line has been gathered
+void parse_line(Parser *p) {
+    char *line = p->line;
+    if (p->line_len && line[p->line_len - 1] == '\r') p->line_len--;
+    line[p->line_len] = '\0';
+
+    if (p->state == PARSE_REQUEST) {
+        // Blank lines between messages are skipped
+        if (!p->line_len) return;
+        char version[16] = "";
+        p->command_name[0] = '\0';
+        p->resource[0] = '\0';
+        p->range[0] = '\0';
+        p->timestamp[0] = '\0';
+        p->visible[0] = '\0';
+        p->body_left = 0;
+        p->failed = 0;
+        p->accept_spans = 0;
+        sscanf(line, "%15s %4095s %15s", p->command_name, p->resource, version);
+        p->command = command_code(p->command_name);
+        p->state = PARSE_HEADERS;
+        if (strcmp(version, SDSLH_VERSION) != 0) reply_error(p, "Expected " SDSLH_VERSION);
+        return;
+    }
+
+    if (p->line_len) {
+        char *value = strchr(line, ':');
+        if (!value) return;
+        *value++ = '\0';
+        while (*value == ' ') value++;
+        if (strcasecmp(line, "Content-Length") == 0) p->body_left = strtoull(value, NULL, 10);
+        else if (strcasecmp(line, "Range") == 0) snprintf(p->range, sizeof(p->range), "%s", value);
+        else if (strcasecmp(line, "Timestamp") == 0) snprintf(p->timestamp, sizeof(p->timestamp), "%s", value);
+        else if (strcasecmp(line, "Visible") == 0) snprintf(p->visible, sizeof(p->visible), "%s", value);
+        else if (strcasecmp(line, "Accept") == 0) p->accept_spans = strstr(value, SPANS_TYPE) != NULL;
+        return;
+    }
+
+    // The blank line ending the headers
+    message_start(p);
+    if (p->body_left) {
+        p->state = PARSE_BODY;
+    } else {
+        message_end(p);
+        p->state = PARSE_REQUEST;
+    }
+}
+
+// Parse everything in the ring
+void parse(Ring *ring, Parser *p) {
+    size_t len;
+    char *data;
+    while ((data = ring_peek(ring, &len)), len) {
+        if (p->state == PARSE_BODY) {
+            size_t n = len < p->body_left ? len : p->body_left;
+            message_body(p, data, n);
+            ring->head += n;
+            p->body_left -= n;
+            if (!p->body_left) {
+                message_end(p);
+                p->state = PARSE_REQUEST;
+            }
+            continue;
+        }
+
+        char *nl = memchr(data, '\n', len);
+        size_t n = nl ? (size_t)(nl - data) : len;
+        size_t room = sizeof(p->line) - 1 - p->line_len;
+        memcpy(p->line + p->line_len, data, n < room ? n : room);
+        p->line_len += n < room ? n : room;
+        ring->head += nl ? n + 1 : n;
+        if (nl) {
+            parse_line(p);
+            p->line_len = 0;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static Ring ring;
+    static Parser parser;
+    static char output[OUTPUT_BUFFER];
+    setvbuf(stdout, output, _IOFBF, sizeof(output));
+
+    int opt;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt == 'j') {
+            threads = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-j threads]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pool_start(threads);
+
+    while (1) {
+        ssize_t n = ring_fill(&ring, STDIN_FILENO);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return EXIT_FAILURE;
+        }
+        parse(&ring, &parser);
+        // Replies go out in one write per batch of requests
+        fflush(stdout);
+    }
+
+    pool_stop();
+    fflush(stdout);
+    for (int i = 0; i < num_documents; i++) {
+        doc_free(documents[i]);
+    }
+    free(documents);
+    free(input_scratch.classes);
+    free(input_scratch.encoded);
+    return 0;
+}
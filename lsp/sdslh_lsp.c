@@ -0,0 +1,777 @@
+//
+// sdslh_lsp - a Language Server Protocol server on stdin/stdout that serves semantic tokens for VS Code and
+// other LSP editors, straight from libsdslh.
+//
+// Each open document is a TextBuffer. didChange edits are applied to it range by range, and a request for
+// tokens re-highlights only what the edits left dirty. semanticTokens/full/delta then sends just the tokens
+// of the rows whose text or colours changed since the last result (the buffer's changed range), as one edit
+// to the integer array the client already has, so a keystroke in a big file costs a few tokens, not the
+// whole file's. Nothing runs in the background between messages, except the parallel highlighting of a
+// freshly opened big file.
+//
+#include "sdslh.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+
+#define MAX_HEADER 1024 // Header lines longer than this are cut short
+#define JSON_MAX_DEPTH 64 // Deeper nesting than this is treated as malformed
+
+// Error codes
+#define LSP_METHOD_NOT_FOUND (-32601)
+#define LSP_INVALID_PARAMS (-32602)
+#define LSP_NOT_INITIALIZED (-32002)
+
+// Document sync kinds
+#define SYNC_INCREMENTAL 2
+
+// The token legend - token types are sent as indexes into it
+const char *const TOKEN_TYPES[] = {"comment", "keyword", "string", "number", "operator", "variable"};
+#define NUM_TOKEN_TYPES ((int)(sizeof(TOKEN_TYPES) / sizeof(TOKEN_TYPES[0])))
+
+// A growing output buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Out;
+
+// An open document, and what the client was last sent for it
+typedef struct {
+    char *uri;
+    TextBuffer buffer;
+    int *sent; // Tokens in each row of the last full or delta result, sent_rows of them
+    int sent_rows;
+    int sent_cap;
+    int result_id; // Of that result - 0 if there has not been one
+} Document;
+
+Document **documents;
+int num_documents;
+int documents_cap;
+int next_result_id = 1;
+int threads; // -j, prehighlight threads for each document
+const Language *forced_language; // -l
+int initialized;
+int shutting_down;
+int exiting;
+
+Out out; // The message being written
+Out tokens; // Scratch for token integers
+
+void out_reserve(Out *o, size_t n) {
+    if (o->len + n <= o->cap) return;
+    o->cap = o->cap * 2 > o->len + n ? o->cap * 2 : o->len + n + 4096;
+    o->data = realloc(o->data, o->cap);
+}
+
+void out_add(Out *o, const char *s, size_t n) {
+    out_reserve(o, n);
+    memcpy(o->data + o->len, s, n);
+    o->len += n;
+}
+
+void out_str(Out *o, const char *s) {
+    out_add(o, s, strlen(s));
+}
+
+void out_printf(Out *o, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    out_reserve(o, n + 1);
+    va_start(args, format);
+    vsnprintf(o->data + o->len, n + 1, format, args);
+    va_end(args);
+    o->len += n;
+}
+
+// A token array can be millions of integers, so they are formatted by hand
+void out_uint(Out *o, unsigned value) {
+    char digits[12];
+    int n = 0;
+    do digits[n++] = (char)('0' + value % 10);
+    while ((value /= 10));
+    out_reserve(o, n);
+    while (n) o->data[o->len++] = digits[--n];
+}
+
+// A JSON string, quoted and escaped
+void out_json_string(Out *o, const char *s) {
+    out_add(o, "\"", 1);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            char escaped[2] = {'\\', (char)c};
+            out_add(o, escaped, 2);
+        } else if (c < 0x20) {
+            out_printf(o, "\\u%04x", c);
+        } else {
+            out_add(o, s, 1);
+        }
+    }
+    out_add(o, "\"", 1);
+}
+
+// JSON is read in place, by pointers into the message - a value is found by skipping over whatever comes
+// before it, so nothing is allocated but the strings wanted out of it. Every function takes NULL for a
+// missing value and gives NULL back.
+
+const char *json_space(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    return p;
+}
+
+// Skip the value at p, returning what follows it, or NULL if it is malformed
+const char *json_skip_depth(const char *p, int depth) {
+    if (!p || depth > JSON_MAX_DEPTH) return NULL;
+    p = json_space(p);
+    if (*p == '"') {
+        for (p++; *p != '"'; p++) {
+            if (!*p) return NULL;
+            if (*p == '\\' && !*++p) return NULL;
+        }
+        return p + 1;
+    }
+    if (*p == '{' || *p == '[') {
+        char close = *p == '{' ? '}' : ']';
+        p = json_space(p + 1);
+        if (*p == close) return p + 1;
+        for (;;) {
+            if (close == '}') {
+                p = json_skip_depth(p, depth + 1);
+                if (!p) return NULL;
+                p = json_space(p);
+                if (*p++ != ':') return NULL;
+            }
+            p = json_skip_depth(p, depth + 1);
+            if (!p) return NULL;
+            p = json_space(p);
+            if (*p == close) return p + 1;
+            if (*p++ != ',') return NULL;
+        }
+    }
+    // A number, true, false or null
+    const char *start = p;
+    while (*p && strchr("+-.0123456789Eaeflnrstu", *p)) p++;
+    return p > start ? p : NULL;
+}
+
+const char *json_skip(const char *p) {
+    return json_skip_depth(p, 0);
+}
+
+// The value of member key of the object at p
+const char *json_member(const char *p, const char *key) {
+    if (!p || *(p = json_space(p)) != '{') return NULL;
+    size_t key_len = strlen(key);
+    p = json_space(p + 1);
+    while (*p == '"') {
+        const char *name = p + 1;
+        const char *end = json_skip(p);
+        if (!end) return NULL;
+        p = json_space(end);
+        if (*p++ != ':') return NULL;
+        p = json_space(p);
+        // Member names are compared as they are, escapes and all - none of the ones looked for have any
+        if ((size_t)(end - 1 - name) == key_len && memcmp(name, key, key_len) == 0) return p;
+        p = json_skip(p);
+        if (!p) return NULL;
+        p = json_space(p);
+        if (*p++ != ',') return NULL;
+        p = json_space(p);
+    }
+    return NULL;
+}
+
+// The first element of the array at p
+const char *json_first(const char *p) {
+    if (!p || *(p = json_space(p)) != '[') return NULL;
+    p = json_space(p + 1);
+    return *p == ']' ? NULL : p;
+}
+
+// The element after the one at p
+const char *json_next(const char *p) {
+    p = json_skip(p);
+    if (!p || *(p = json_space(p)) != ',') return NULL;
+    return json_space(p + 1);
+}
+
+int json_int(const char *p, int fallback) {
+    if (!p || (*p != '-' && (*p < '0' || *p > '9'))) return fallback;
+    return (int)strtol(p, NULL, 10);
+}
+
+void utf8_put(char **q, unsigned c) {
+    char *s = *q;
+    if (c < 0x80) {
+        *s++ = (char)c;
+    } else if (c < 0x800) {
+        *s++ = (char)(0xC0 | c >> 6);
+        *s++ = (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        *s++ = (char)(0xE0 | c >> 12);
+        *s++ = (char)(0x80 | (c >> 6 & 0x3F));
+        *s++ = (char)(0x80 | (c & 0x3F));
+    } else {
+        *s++ = (char)(0xF0 | c >> 18);
+        *s++ = (char)(0x80 | (c >> 12 & 0x3F));
+        *s++ = (char)(0x80 | (c >> 6 & 0x3F));
+        *s++ = (char)(0x80 | (c & 0x3F));
+    }
+    *q = s;
+}
+
+unsigned hex4(const char *p) {
+    unsigned v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        v = v << 4 | (unsigned)(c >= 'a' ? c - 'a' + 10 : c >= 'A' ? c - 'A' + 10 : c - '0');
+    }
+    return v;
+}
+
+// The string at p, unescaped into a new NUL-terminated block (which may also hold NULs), with its length in
+// *len if that is wanted
+char *json_string(const char *p, size_t *len) {
+    if (!p || *p != '"') return NULL;
+    const char *end = json_skip(p);
+    if (!end) return NULL;
+    // Unescaping never makes a string longer - \uXXXX is at most four bytes of UTF-8
+    char *s = malloc(end - p);
+    char *q = s;
+    for (p++; p < end - 1; p++) {
+        if (*p != '\\') {
+            *q++ = *p;
+            continue;
+        }
+        switch (*++p) {
+            case 'b': *q++ = '\b'; break;
+            case 'f': *q++ = '\f'; break;
+            case 'n': *q++ = '\n'; break;
+            case 'r': *q++ = '\r'; break;
+            case 't': *q++ = '\t'; break;
+            case 'u': {
+                if (end - 1 - p < 5) break;
+                unsigned c = hex4(p + 1);
+                p += 4;
+                // A surrogate pair is one character
+                if (c >= 0xD800 && c < 0xDC00 && end - 1 - p >= 7 && p[1] == '\\' && p[2] == 'u') {
+                    unsigned low = hex4(p + 3);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                }
+                utf8_put(&q, c);
+                break;
+            }
+            default: *q++ = *p; break;
+        }
+    }
+    *q = '\0';
+    if (len) *len = q - s;
+    return s;
+}
+
+// Write out the message built in out
+void send_message(void) {
+    printf("Content-Length: %zu\r\n\r\n", out.len);
+    fwrite(out.data, 1, out.len, stdout);
+    fflush(stdout);
+    out.len = 0;
+}
+
+// Start a response to the request with the given id (its JSON as it came), up to the result
+void response_start(const char *id) {
+    out.len = 0;
+    out_str(&out, "{\"jsonrpc\":\"2.0\",\"id\":");
+    if (id) out_add(&out, id, json_skip(id) - id);
+    else out_str(&out, "null");
+    out_str(&out, ",\"result\":");
+}
+
+void response_end(void) {
+    out_str(&out, "}");
+    send_message();
+}
+
+void respond_null(const char *id) {
+    response_start(id);
+    out_str(&out, "null");
+    response_end();
+}
+
+void respond_error(const char *id, int code, const char *message) {
+    out.len = 0;
+    out_str(&out, "{\"jsonrpc\":\"2.0\",\"id\":");
+    if (id) out_add(&out, id, json_skip(id) - id);
+    else out_str(&out, "null");
+    out_printf(&out, ",\"error\":{\"code\":%d,\"message\":", code);
+    out_json_string(&out, message);
+    out_str(&out, "}}");
+    send_message();
+}
+
+// Positions are in UTF-16 code units, as LSP counts them, and rows are in bytes of UTF-8
+
+// UTF-16 code units in n bytes of UTF-8
+int utf16_len(const char *chars, int n) {
+    int units = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)chars[i];
+        // Continuation bytes add nothing, and a four byte character is a surrogate pair
+        if ((c & 0xC0) != 0x80) units += c >= 0xF0 ? 2 : 1;
+    }
+    return units;
+}
+
+// The byte in a row that is character (in UTF-16 code units) along it
+int row_byte(Row *row, int character) {
+    row_flatten(row);
+    int i = 0;
+    for (int units = 0; i < row->len && units < character;) {
+        unsigned char c = (unsigned char)row->chars[i];
+        int step = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+        units += step == 4 ? 2 : 1;
+        i += step;
+    }
+    return i < row->len ? i : row->len;
+}
+
+// The token type of a PAIR_* colour, or -1 if it is not sent as a token. LSP has no token type for errors -
+// they are for diagnostics.
+int pair_token(int pair) {
+    switch (pair) {
+        case PAIR_COMMENT: return 0;
+        case PAIR_KEYWORD: return 1;
+        case PAIR_STRING: return 2;
+        case PAIR_NUM: return 3;
+        case PAIR_OPERATOR: return 4;
+        case PAIR_VARIABLE: return 5;
+        default: return -1;
+    }
+}
+
+// Append row y's tokens to the token scratch as LSP encodes them, each relative to the one before, which
+// was at *line and *col (both 0 for the first) - these are moved on to the row's last token. Stops after max
+// tokens. Returns the number of tokens.
+int row_tokens(TextBuffer *buffer, int y, int *line, int *col, int max) {
+    Row *row = buffer_row(buffer, y);
+    if (!row->run_len) return 0;
+    row_flatten(row);
+    int ascii = 1;
+    for (int i = 0; i < row->len && ascii; i++) ascii = (unsigned char)row->chars[i] < 0x80;
+
+    const unsigned char *p = row->runs;
+    const unsigned char *end = row->runs + row->run_len;
+    int last_end = 0;
+    int count = 0;
+    int byte = 0, unit = 0; // How far along the row UTF-16 units have been counted
+    while (p < end && count < max) {
+        Run run;
+        p = unpack_run(p, &run, last_end);
+        last_end = run.start + run.len;
+        int type = pair_token(run.pair);
+        if (type < 0) continue;
+        int start = run.start, len = run.len;
+        if (!ascii) {
+            unit += utf16_len(row->chars + byte, run.start - byte);
+            byte = run.start;
+            start = unit;
+            len = utf16_len(row->chars + run.start, run.len);
+        }
+        int delta_line = y - *line;
+        out_reserve(&tokens, 5 * 12);
+        out_uint(&tokens, delta_line);
+        out_add(&tokens, ",", 1);
+        out_uint(&tokens, delta_line ? start : start - *col);
+        out_add(&tokens, ",", 1);
+        out_uint(&tokens, len);
+        out_add(&tokens, ",", 1);
+        out_uint(&tokens, type);
+        out_add(&tokens, ",0,", 3);
+        *line = y;
+        *col = start;
+        count++;
+    }
+    return count;
+}
+
+// Before tokens are sent - everything dirty is re-highlighted, and the rest of a newly opened document
+// highlighted, waiting for its parallel highlighting threads where they have not got there yet
+void document_highlight(Document *document) {
+    TextBuffer *buffer = &document->buffer;
+    highlight_dirty(buffer);
+    while (highlight_catch_up(buffer, HIGHLIGHT_CHUNK)) {
+        if (!buffer->prehighlight.waiting) continue;
+        struct pollfd fd = {buffer->prehighlight.wake[0], POLLIN, 0};
+        poll(&fd, 1, -1);
+        char drain[64];
+        while (read(buffer->prehighlight.wake[0], drain, sizeof(drain)) > 0) continue;
+    }
+}
+
+void sent_reserve(Document *document, int rows) {
+    if (rows <= document->sent_cap) return;
+    document->sent_cap = rows * 2;
+    document->sent = realloc(document->sent, sizeof(int) * document->sent_cap);
+}
+
+// End the token scratch's list, dropping the trailing comma
+void tokens_end(void) {
+    if (tokens.len) tokens.len--;
+}
+
+// Reply with every token of the document, and remember what was sent
+void respond_full(const char *id, Document *document) {
+    TextBuffer *buffer = &document->buffer;
+    document_highlight(document);
+    tokens.len = 0;
+    sent_reserve(document, buffer->num_rows);
+    int line = 0, col = 0;
+    for (int y = 0; y < buffer->num_rows; y++) document->sent[y] = row_tokens(buffer, y, &line, &col, INT_MAX);
+    tokens_end();
+    document->sent_rows = buffer->num_rows;
+    document->result_id = next_result_id++;
+    buffer->changed_start = -1;
+
+    response_start(id);
+    out_printf(&out, "{\"resultId\":\"%d\",\"data\":[", document->result_id);
+    out_add(&out, tokens.data, tokens.len);
+    out_str(&out, "]}");
+    response_end();
+}
+
+// Reply with one edit to the last result sent, replacing the tokens of the changed rows. The first token
+// after them is in it too, as it is encoded relative to the last token before it, which may have moved.
+void respond_delta(const char *id, Document *document) {
+    TextBuffer *buffer = &document->buffer;
+    document_highlight(document);
+    int start = buffer->changed_start;
+    long long before = 0, deleted = 0, inserted = 0;
+    tokens.len = 0;
+    if (start >= 0) {
+        // Rows start..old_end of what was sent are now rows start..new_end
+        if (start > document->sent_rows) start = document->sent_rows;
+        int new_end = buffer->changed_end < buffer->num_rows ? buffer->changed_end : buffer->num_rows - 1;
+        int old_end = buffer->changed_end - buffer->changed_rows;
+        if (old_end >= document->sent_rows) old_end = document->sent_rows - 1;
+        if (new_end < start - 1) new_end = start - 1;
+        if (old_end < start - 1) old_end = start - 1;
+        int old_rows = old_end - start + 1;
+        int new_rows = new_end - start + 1;
+
+        // The integers before the changed rows stay as they are - only the line of the last token before
+        // them matters, as the next token is on a later line whatever its column
+        int line = 0, col = 0;
+        for (int y = 0; y < start; y++) before += document->sent[y];
+        for (int y = start - 1; y >= 0; y--) {
+            if (!document->sent[y]) continue;
+            line = y;
+            break;
+        }
+        for (int y = start; y <= old_end; y++) deleted += document->sent[y];
+        int next = old_end + 1;
+        while (next < document->sent_rows && !document->sent[next]) next++;
+        int has_next = next < document->sent_rows;
+
+        // The changed rows' counts take the place of the old ones
+        int tail = document->sent_rows - (old_end + 1);
+        sent_reserve(document, document->sent_rows + new_rows - old_rows);
+        memmove(document->sent + start + new_rows, document->sent + old_end + 1, sizeof(int) * tail);
+        document->sent_rows += new_rows - old_rows;
+        for (int y = start; y <= new_end; y++) {
+            document->sent[y] = row_tokens(buffer, y, &line, &col, INT_MAX);
+            inserted += document->sent[y];
+        }
+        if (has_next) {
+            row_tokens(buffer, next + new_rows - old_rows, &line, &col, 1);
+            deleted++;
+            inserted++;
+        }
+        tokens_end();
+    }
+    document->result_id = next_result_id++;
+    buffer->changed_start = -1;
+
+    response_start(id);
+    out_printf(&out, "{\"resultId\":\"%d\",\"edits\":[", document->result_id);
+    if (deleted || inserted) {
+        out_printf(&out, "{\"start\":%lld,\"deleteCount\":%lld,\"data\":[", 5 * before, 5 * deleted);
+        out_add(&out, tokens.data, tokens.len);
+        out_str(&out, "]}");
+    }
+    out_str(&out, "]}");
+    response_end();
+}
+
+// Reply with the tokens of lines start..end (inclusive) - only those rows are sure to be highlighted, and
+// nothing is remembered, as a range result is not the base for a delta
+void respond_range(const char *id, Document *document, int start, int end) {
+    TextBuffer *buffer = &document->buffer;
+    if (end >= buffer->num_rows) end = buffer->num_rows - 1;
+    highlight_dirty(buffer);
+    highlight_visible(buffer, start, end);
+    tokens.len = 0;
+    int line = 0, col = 0;
+    for (int y = start; y <= end; y++) row_tokens(buffer, y, &line, &col, INT_MAX);
+    tokens_end();
+
+    response_start(id);
+    out_str(&out, "{\"data\":[");
+    out_add(&out, tokens.data, tokens.len);
+    out_str(&out, "]}");
+    response_end();
+}
+
+Document *document_find(const char *uri) {
+    for (int i = 0; i < num_documents; i++) {
+        if (strcmp(documents[i]->uri, uri) == 0) return documents[i];
+    }
+    return NULL;
+}
+
+// The document the params of a message are about
+Document *document_for(const char *params) {
+    char *uri = json_string(json_member(json_member(params, "textDocument"), "uri"), NULL);
+    if (!uri) return NULL;
+    Document *document = document_find(uri);
+    free(uri);
+    return document;
+}
+
+// Load a document's text, highlighting with language, or by the extension in its URI if that is NULL. The
+// language has to be set before load_text(), which starts highlighting with it on other threads.
+void document_load(Document *document, const Language *language, const char *text, size_t len) {
+    TextBuffer *buffer = &document->buffer;
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->dirty_start = -1;
+    buffer->dirty_end = -1;
+    buffer->threads = threads;
+    buffer->language = language;
+    load_text(buffer, document->uri, text, len);
+    // LSP counts the empty line after a final newline as a line, and so must the rows
+    if (len && text[len - 1] == '\n') {
+        int x = buffer_row(buffer, buffer->num_rows - 1)->len, y = buffer->num_rows - 1;
+        insert_text(buffer, &x, &y, "\n", 1);
+    }
+    document->sent_rows = 0;
+    document->result_id = 0;
+}
+
+void did_open(const char *params) {
+    const char *item = json_member(params, "textDocument");
+    char *uri = json_string(json_member(item, "uri"), NULL);
+    size_t len;
+    char *text = json_string(json_member(item, "text"), &len);
+    char *language_id = json_string(json_member(item, "languageId"), NULL);
+    if (uri && text) {
+        Document *document = document_find(uri);
+        if (document) {
+            // Opened again without being closed - start it over
+            free_buffer(&document->buffer);
+            free(uri);
+        } else {
+            if (num_documents == documents_cap) {
+                documents_cap = documents_cap * 2 + 8;
+                documents = realloc(documents, sizeof(Document *) * documents_cap);
+            }
+            // Each document stays where it is, as its buffer's threads hold on to it
+            document = calloc(1, sizeof(Document));
+            document->uri = uri;
+            documents[num_documents++] = document;
+        }
+        // The language the client says it is in, if there is a built-in one by that name
+        const Language *language = forced_language;
+        if (!language && language_id) language = language_named(language_id);
+        document_load(document, language, text, len);
+    } else {
+        free(uri);
+    }
+    free(text);
+    free(language_id);
+}
+
+// The row and byte of an LSP position, clamped to the document
+void position_of(TextBuffer *buffer, const char *position, int *x, int *y) {
+    *y = json_int(json_member(position, "line"), 0);
+    int character = json_int(json_member(position, "character"), 0);
+    if (*y < 0) *y = 0;
+    if (*y >= buffer->num_rows) {
+        *y = buffer->num_rows - 1;
+        character = INT_MAX;
+    }
+    *x = row_byte(buffer_row(buffer, *y), character < 0 ? 0 : character);
+}
+
+// Apply each change in turn - a range with the text to replace it, or the whole text again
+void did_change(const char *params) {
+    Document *document = document_for(params);
+    if (!document) return;
+    TextBuffer *buffer = &document->buffer;
+    for (const char *change = json_first(json_member(params, "contentChanges")); change; change = json_next(change)) {
+        size_t len;
+        char *text = json_string(json_member(change, "text"), &len);
+        if (!text) continue;
+        const char *range = json_member(change, "range");
+        if (range) {
+            int x1, y1, x2, y2;
+            position_of(buffer, json_member(range, "start"), &x1, &y1);
+            position_of(buffer, json_member(range, "end"), &x2, &y2);
+            delete_text(buffer, x1, y1, x2, y2);
+            insert_text(buffer, &x1, &y1, text, len);
+        } else {
+            const Language *language = buffer->language;
+            free_buffer(buffer);
+            document_load(document, language, text, len);
+        }
+        free(text);
+    }
+}
+
+void did_close(const char *params) {
+    Document *document = document_for(params);
+    if (!document) return;
+    for (int i = 0; i < num_documents; i++) {
+        if (documents[i] != document) continue;
+        documents[i] = documents[--num_documents];
+        break;
+    }
+    free_buffer(&document->buffer);
+    free(document->sent);
+    free(document->uri);
+    free(document);
+}
+
+void initialize(const char *id) {
+    initialized = 1;
+    response_start(id);
+    out_printf(&out, "{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,\"change\":%d},"
+               "\"semanticTokensProvider\":{\"legend\":{\"tokenTypes\":[", SYNC_INCREMENTAL);
+    for (int i = 0; i < NUM_TOKEN_TYPES; i++) {
+        if (i) out_str(&out, ",");
+        out_json_string(&out, TOKEN_TYPES[i]);
+    }
+    out_str(&out, "],\"tokenModifiers\":[]},\"range\":true,\"full\":{\"delta\":true}}},"
+            "\"serverInfo\":{\"name\":\"sdslh_lsp\"}}");
+    response_end();
+}
+
+// Handle one message - requests have an id and are answered, notifications are not
+void handle_message(const char *message) {
+    const char *id = json_member(message, "id");
+    if (!json_skip(id)) id = NULL;
+    const char *params = json_member(message, "params");
+    char *method = json_string(json_member(message, "method"), NULL);
+    // Replies to requests of ours (there are none) are ignored, as is anything without a method
+    if (!method) return;
+
+    if (strcmp(method, "initialize") == 0) {
+        initialize(id);
+    } else if (strcmp(method, "exit") == 0) {
+        exiting = 1;
+    } else if (!initialized) {
+        if (id) respond_error(id, LSP_NOT_INITIALIZED, "Not initialized");
+    } else if (strcmp(method, "shutdown") == 0) {
+        shutting_down = 1;
+        respond_null(id);
+    } else if (strcmp(method, "textDocument/didOpen") == 0) {
+        did_open(params);
+    } else if (strcmp(method, "textDocument/didChange") == 0) {
+        did_change(params);
+    } else if (strcmp(method, "textDocument/didClose") == 0) {
+        did_close(params);
+    } else if (strncmp(method, "textDocument/semanticTokens/", 28) == 0 && id) {
+        Document *document = document_for(params);
+        const char *kind = method + 28;
+        if (!document) {
+            respond_error(id, LSP_INVALID_PARAMS, "Unknown document");
+        } else if (strcmp(kind, "full") == 0) {
+            respond_full(id, document);
+        } else if (strcmp(kind, "full/delta") == 0) {
+            // A delta can only be from the last result - for anything else the client gets them all again
+            char *previous = json_string(json_member(params, "previousResultId"), NULL);
+            if (document->result_id && previous && atoi(previous) == document->result_id) respond_delta(id, document);
+            else respond_full(id, document);
+            free(previous);
+        } else if (strcmp(kind, "range") == 0) {
+            const char *range = json_member(params, "range");
+            int start = json_int(json_member(json_member(range, "start"), "line"), 0);
+            int end = json_int(json_member(json_member(range, "end"), "line"), 0);
+            respond_range(id, document, start < 0 ? 0 : start, end);
+        } else {
+            respond_error(id, LSP_METHOD_NOT_FOUND, "Method not found");
+        }
+    } else if (id) {
+        respond_error(id, LSP_METHOD_NOT_FOUND, "Method not found");
+    }
+    free(method);
+}
+
+// Read one message's body into *message, growing it as needed. Returns false at the end of the input.
+int read_message(char **message, size_t *cap) {
+    char header[MAX_HEADER];
+    long length = -1;
+    for (;;) {
+        if (!fgets(header, sizeof(header), stdin)) return 0;
+        if (strcmp(header, "\r\n") == 0 || strcmp(header, "\n") == 0) {
+            if (length >= 0) break;
+            continue;
+        }
+        if (strncasecmp(header, "Content-Length:", 15) == 0) length = strtol(header + 15, NULL, 10);
+    }
+    if ((size_t)length + 1 > *cap) {
+        *cap = (size_t)length + 1;
+        *message = realloc(*message, *cap);
+    }
+    if (fread(*message, 1, length, stdin) != (size_t)length) return 0;
+    (*message)[length] = '\0';
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "j:l:t")) != -1) {
+        if (opt == 'j') {
+            threads = atoi(optarg);
+        } else if (opt == 'l') {
+            forced_language = language_named(optarg);
+            if (!forced_language) {
+                fprintf(stderr, "Unknown language %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+        } else if (opt == 't') {
+            stats.enabled = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-j threads] [-l language] [-t]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char *message = NULL;
+    size_t cap = 0;
+    while (!exiting && read_message(&message, &cap)) handle_message(message);
+
+    if (stats.enabled) stats_dump(stderr);
+    for (int i = 0; i < num_documents; i++) {
+        free_buffer(&documents[i]->buffer);
+        free(documents[i]->sent);
+        free(documents[i]->uri);
+        free(documents[i]);
+    }
+    free(documents);
+    free(message);
+    free(out.data);
+    free(tokens.data);
+    scratch_free();
+    // Exiting without being asked to shut down first is an error
+    return exiting && !shutting_down ? EXIT_FAILURE : EXIT_SUCCESS;
+}
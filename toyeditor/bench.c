@@ -0,0 +1,384 @@
+//
+// te_bench - runs the toy editor's buffer, highlighting and rendering without a terminal, through synthetic
+// workloads and recorded keystroke traces, and reports throughput and latency for each.
+//
+// Every key goes through editor_key() as it does in te, then the results the highlight thread has sent back
+// are applied and the screen is redrawn (into null_screen.h's memory), and the time for all of that is one
+// sample. A workload's total time also takes in waiting for the highlight thread to finish at the end.
+//
+#define TE_BENCH
+#include "editor.c"
+
+#define BENCH_BIG_ROWS 1000000 // Rows in the big file, -n to change
+#define BENCH_SMALL_ROWS 10000
+#define BENCH_BURSTS 200 // Typing bursts, each at a random place
+#define BENCH_BURST_KEYS 40
+#define BENCH_PASTE_BYTES (256 * 1024)
+#define BENCH_JOINS 5000
+#define BENCH_SCROLL_KEYS 20000
+
+typedef struct {
+    const char *name;
+    long long ops;
+    long long total; // ns
+    Histogram latency;
+} Result;
+
+Result results[16];
+int num_results;
+char bench_dir[PATH_MAX];
+int threads; // -j, prehighlight threads for every buffer
+
+// One made-up line of the toy language - mostly assignments, with comments and strings now and then
+int synthetic_line(char *out, size_t size, int i) {
+    switch (rand() % 8) {
+        case 0: return snprintf(out, size, "# comment about line %d", i);
+        case 1: return snprintf(out, size, "say \"value %d is\" var_%d /* note */", i, i % 97);
+        case 2: return snprintf(out, size, "if var_%d > %d then call proc_%d", i % 89, i, i % 13);
+        default: return snprintf(out, size, "var_%d = var_%d + %d * (x - %d)", i, i % 101, i % 1000, i % 7);
+    }
+}
+
+// Write a file of rows synthetic lines to the bench directory and return its name
+const char *synthetic_file(int rows, char *name, size_t size) {
+    snprintf(name, size, "%s/te_bench_%d.dsl", bench_dir, rows);
+    FILE *fp = fopen(name, "w");
+    if (!fp) die(name);
+    char line[256];
+    srand(rows);
+    for (int i = 0; i < rows; i++) {
+        synthetic_line(line, sizeof(line), i);
+        fprintf(fp, "%s\n", line);
+    }
+    if (fclose(fp) != 0) die(name);
+    return name;
+}
+
+Result *result_new(const char *name) {
+    Result *result = &results[num_results++];
+    memset(result, 0, sizeof(*result));
+    result->name = name;
+    return result;
+}
+
+// Highlight every row, waiting for the parallel prehighlight threads where the catch-up pass gets ahead
+void highlight_all(TextBuffer *buffer) {
+    while (highlight_catch_up(buffer, HIGHLIGHT_CHUNK)) {
+        if (!buffer->prehighlight.waiting) continue;
+        struct pollfd fd = {buffer->prehighlight.wake[0], POLLIN, 0};
+        poll(&fd, 1, -1);
+        char drain[64];
+        while (read(buffer->prehighlight.wake[0], drain, sizeof(drain)) > 0) continue;
+    }
+}
+
+// Wait for everything sent to the highlight thread, and whatever it leads to, to be applied
+void highlight_drain(TextBuffer *buffer) {
+    while (buffer->num_jobs_sent || buffer->dirty_start >= 0) {
+        if (buffer->num_jobs_sent) {
+            struct pollfd fd = {buffer->worker.wake[0], POLLIN, 0};
+            poll(&fd, 1, -1);
+        }
+        highlight_worker_collect(buffer);
+        highlight_dirty(buffer);
+    }
+}
+
+// A loaded file ready for keys, with the screen drawn once
+typedef struct {
+    TextBuffer buffer;
+    const char *filename;
+    int cursor_x;
+    int cursor_y;
+} Session;
+
+void session_open(Session *session, const char *filename, const Language *language) {
+    memset(session, 0, sizeof(*session));
+    session->buffer = (TextBuffer){.dirty_start = -1, .dirty_end = -1, .language = language, .threads = threads};
+    session->filename = filename;
+    load_file(&session->buffer, filename);
+    highlight_worker_start(&session->buffer);
+    scroll_line = 0;
+    scroll_col = 0;
+    frame_reset(LINES, COLS);
+    clear();
+    editor_refresh(&session->buffer, 0, 0);
+}
+
+void session_close(Session *session) {
+    free_buffer(&session->buffer);
+    status_message[0] = '\0';
+}
+
+// Press a key, along with any waiting behind it, and time it through to the screen being redrawn
+void session_key(Session *session, Result *result, int c) {
+    long long start = now_ns();
+    editor_keys(&session->buffer, session->filename, c, &session->cursor_x, &session->cursor_y);
+    highlight_worker_collect(&session->buffer);
+    editor_refresh(&session->buffer, session->cursor_x, session->cursor_y);
+    histogram_record(&result->latency, now_ns() - start);
+    result->ops++;
+}
+
+void session_goto(Session *session, int x, int y) {
+    session->cursor_y = y;
+    int len = buffer_row(&session->buffer, y)->len;
+    session->cursor_x = x < len ? x : len;
+}
+
+// Time loading a file until every row is highlighted, then saving it
+void bench_load_save(const char *load_name, const char *save_name, int rows, const Language *language) {
+    char filename[PATH_MAX];
+    synthetic_file(rows, filename, sizeof(filename));
+
+    Result *load = result_new(load_name);
+    long long start = now_ns();
+    TextBuffer buffer = {.dirty_start = -1, .dirty_end = -1, .language = language, .threads = threads};
+    load_file(&buffer, filename);
+    highlight_all(&buffer);
+    load->total = now_ns() - start;
+    histogram_record(&load->latency, load->total);
+    load->ops = 1;
+
+    // Touch a row in every thousand so the save is not all one unedited stretch
+    for (int y = 0; y < buffer.num_rows; y += 1000) insert_char(&buffer, 0, y, 'x');
+    Result *save = result_new(save_name);
+    start = now_ns();
+    save_file(&buffer, filename);
+    save_finish(&buffer);
+    save->total = now_ns() - start;
+    histogram_record(&save->latency, save->total);
+    save->ops = 1;
+
+    free_buffer(&buffer);
+    unlink(filename);
+}
+
+// Time reopening a file whose highlighting was cached when it was last closed, as it was and then with
+// its first row changed, so every other row has to be looked up by its text
+void bench_cache(int rows, const Language *language) {
+    char filename[PATH_MAX];
+    char cache_dir[PATH_MAX + 8];
+    synthetic_file(rows, filename, sizeof(filename));
+    snprintf(cache_dir, sizeof(cache_dir), "%s/cache", bench_dir);
+
+    TextBuffer buffer = {.dirty_start = -1, .dirty_end = -1, .language = language, .threads = threads,
+                         .cache_dir = cache_dir};
+    load_file(&buffer, filename);
+    highlight_all(&buffer);
+    free_buffer(&buffer);
+
+    for (int changed = 0; changed < 2; changed++) {
+        if (changed) {
+            int fd = open(filename, O_WRONLY);
+            if (fd < 0 || write(fd, "#", 1) != 1 || close(fd) != 0) die(filename);
+        }
+        Result *result = result_new(changed ? "load cached edit" : "load cached");
+        long long start = now_ns();
+        buffer = (TextBuffer){.dirty_start = -1, .dirty_end = -1, .language = language, .threads = threads,
+                              .cache_dir = cache_dir};
+        load_file(&buffer, filename);
+        highlight_all(&buffer);
+        result->total = now_ns() - start;
+        histogram_record(&result->latency, result->total);
+        result->ops = 1;
+        free_buffer(&buffer);
+    }
+
+    char cache[2 * PATH_MAX];
+    cache_path(cache_dir, filename, cache, sizeof(cache));
+    unlink(cache);
+    rmdir(cache_dir);
+    unlink(filename);
+}
+
+// Bursts of typing, each at a random place
+void bench_typing(Session *session) {
+    Result *result = result_new("typing");
+    long long start = now_ns();
+    srand(1);
+    for (int burst = 0; burst < BENCH_BURSTS; burst++) {
+        session_goto(session, rand() % 40, rand() % session->buffer.num_rows);
+        for (int i = 0; i < BENCH_BURST_KEYS; i++) {
+            int c = rand() % 10 ? 'a' + rand() % 26 : " \"#/*"[rand() % 5];
+            session_key(session, result, c);
+        }
+    }
+    highlight_drain(&session->buffer);
+    result->total = now_ns() - start;
+}
+
+// A large paste arrives as a stream of keys, all waiting at once as they do from a terminal, so it goes in
+// through editor_paste() - ops are keys pasted
+void bench_paste(Session *session) {
+    Result *result = result_new("paste");
+    long long start = now_ns();
+    srand(2);
+    session_goto(session, 0, session->buffer.num_rows / 2);
+    char line[256];
+    int sent = 0;
+    for (int i = 0; sent < BENCH_PASTE_BYTES; i++) {
+        int n = synthetic_line(line, sizeof(line), i);
+        for (int j = 0; j < n; j++) null_screen_key(line[j]);
+        null_screen_key('\n');
+        sent += n + 1;
+    }
+    for (int c; (c = getch()) != ERR;) session_key(session, result, c);
+    highlight_drain(&session->buffer);
+    result->total = now_ns() - start;
+    result->ops = sent;
+}
+
+// Backspace at the start of random rows
+void bench_joins(Session *session) {
+    Result *result = result_new("joins");
+    long long start = now_ns();
+    srand(3);
+    for (int i = 0; i < BENCH_JOINS && session->buffer.num_rows > 1; i++) {
+        session_goto(session, 0, 1 + rand() % (session->buffer.num_rows - 1));
+        session_key(session, result, KEY_BACKSPACE);
+    }
+    highlight_drain(&session->buffer);
+    result->total = now_ns() - start;
+}
+
+// Cursor down through the file, scrolling all the way
+void bench_scroll(Session *session) {
+    Result *result = result_new("scroll");
+    long long start = now_ns();
+    session_goto(session, 0, 0);
+    for (int i = 0; i < BENCH_SCROLL_KEYS; i++) session_key(session, result, KEY_DOWN);
+    result->total = now_ns() - start;
+}
+
+// The same with the keys all waiting at once, as when one is held down faster than the screen is drawn, so
+// editor_keys() does them a frame at a time - ops are keys
+void bench_scroll_burst(Session *session) {
+    Result *result = result_new("scroll burst");
+    long long start = now_ns();
+    session_goto(session, 0, 0);
+    for (int i = 0; i < BENCH_SCROLL_KEYS; i++) null_screen_key(KEY_DOWN);
+    for (int c; (c = getch()) != ERR;) session_key(session, result, c);
+    result->total = now_ns() - start;
+    result->ops = BENCH_SCROLL_KEYS;
+}
+
+// Replay a trace of what the terminal sent - raw bytes, as recorded by script(1) or a tee on the tty. The
+// keys te acts on are decoded just as ncurses would, and anything else is passed on, so it is ignored.
+void bench_trace(Session *session, const char *trace) {
+    FILE *fp = fopen(trace, "rb");
+    if (!fp) die(trace);
+    Result *result = result_new("trace");
+    long long start = now_ns();
+    int c;
+    while ((c = getc(fp)) != EOF) {
+        if (c == '\r') c = '\n';
+        else if (c == 8) c = KEY_BACKSPACE;
+        else if (c == 27) {
+            // ESC [ x or ESC O x for the arrow keys
+            int next = getc(fp);
+            if (next == '[' || next == 'O') next = getc(fp);
+            if (next == 'A') c = KEY_UP;
+            else if (next == 'B') c = KEY_DOWN;
+            else if (next == 'C') c = KEY_RIGHT;
+            else if (next == 'D') c = KEY_LEFT;
+            else continue;
+        }
+        // A quit in the trace ends it, and a save goes to the scratch copy
+        if (c == CTRL_KEY('q')) break;
+        session_key(session, result, c);
+    }
+    fclose(fp);
+    highlight_drain(&session->buffer);
+    result->total = now_ns() - start;
+}
+
+void report(FILE *fp) {
+    fprintf(fp, "%-16s %10s %10s %12s %10s %10s %10s\n", "workload", "ops", "total s", "ops/s", "p50 ms",
+            "p99 ms", "max ms");
+    for (int i = 0; i < num_results; i++) {
+        Result *result = &results[i];
+        double seconds = result->total / 1e9;
+        fprintf(fp, "%-16s %10lld %10.3f %12.0f %10.3f %10.3f %10.3f\n", result->name, result->ops, seconds,
+                seconds > 0 ? result->ops / seconds : 0, stat_percentile(&result->latency, 50) / 1e6,
+                stat_percentile(&result->latency, 99) / 1e6, result->latency.max / 1e6);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int big_rows = BENCH_BIG_ROWS;
+    const char *trace = NULL;
+    const char *trace_file = NULL;
+    const Language *language = NULL;
+    while ((opt = getopt(argc, argv, "f:j:k:l:n:")) != -1) {
+        if (opt == 'f') {
+            trace_file = optarg;
+        } else if (opt == 'j') {
+            threads = atoi(optarg);
+        } else if (opt == 'k') {
+            trace = optarg;
+        } else if (opt == 'l') {
+            language = language_named(optarg);
+            if (!language) {
+                fprintf(stderr, "Unknown language %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+        } else if (opt == 'n') {
+            big_rows = atoi(optarg);
+        } else {
+            printf("Usage: %s [-j threads] [-l language] [-n big_file_rows] [-k trace [-f file]]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Scratch files go in a directory of their own
+    const char *tmp = getenv("TMPDIR");
+    snprintf(bench_dir, sizeof(bench_dir), "%s/te_bench.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(bench_dir)) die("mkdtemp");
+    initscr();
+
+    bench_load_save("load 10k", "save 10k", BENCH_SMALL_ROWS, language);
+    bench_load_save("load big", "save big", big_rows, language);
+    bench_cache(big_rows, language);
+
+    char filename[PATH_MAX];
+    Session session;
+    synthetic_file(BENCH_SMALL_ROWS, filename, sizeof(filename));
+    session_open(&session, filename, language);
+    bench_typing(&session);
+    bench_paste(&session);
+    bench_joins(&session);
+    bench_scroll(&session);
+    bench_scroll_burst(&session);
+    session_close(&session);
+    unlink(filename);
+
+    if (trace) {
+        // The trace is replayed on a copy, so a save in it leaves the original alone
+        char copy[2 * PATH_MAX];
+        if (trace_file) {
+            const char *base = strrchr(trace_file, '/');
+            snprintf(copy, sizeof(copy), "%s/%s", bench_dir, base ? base + 1 : trace_file);
+            TextBuffer original = {.dirty_start = -1, .dirty_end = -1, .language = language};
+            load_file(&original, trace_file);
+            save_file(&original, copy);
+            save_finish(&original);
+            free_buffer(&original);
+        } else {
+            synthetic_file(BENCH_SMALL_ROWS, copy, sizeof(copy));
+        }
+        session_open(&session, copy, language);
+        bench_trace(&session, trace);
+        session_close(&session);
+        unlink(copy);
+    }
+
+    rmdir(bench_dir);
+    endwin();
+    report(stdout);
+    free(frame.chars);
+    free(paste);
+    scratch_free();
+    return 0;
+}
@@ -1,144 +1,143 @@
 //
 // Created by Adrian Sutherland on 11/10/2024.
 //
+#ifdef TE_BENCH
+#include "null_screen.h" // te_bench runs without a terminal
+#else
 #include <ncurses.h>
+#endif
+#include "sdslh.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <strings.h>
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define MAX_LINES 1000
-#define MAX_LINE_LENGTH 1024
 #define FOOTER_TEXT " Toy Editor  -  Ctrl-Q to quit  -  Ctrl-S to save"
 #define HEADER_TEXT " File: %s"
-
-// Colour pairs
-#define PAIR_HEADER 1
-#define PAIR_FOOTER 2
-#define PAIR_BODY 3
-#define PAIR_COMMENT 4
-#define PAIR_KEYWORD 5
-#define PAIR_STRING 6
-#define PAIR_NUM 7
-#define PAIR_OPERATOR 8
-#define PAIR_VARIABLE 9
-#define PAIR_ERROR 10
-
-// For the file name
-char loaded_filename[256];
+#define HIGHLIGHT_PREFETCH 100 // Default rows either side of the screen highlighted along with it
+#define FRAME_BUDGET 16 // Default ms between screen redraws while keys keep coming
+#define HIGHLIGHTER_PING_INTERVAL 2000 // ms between PINGs to the highlighter process
+#define HIGHLIGHTER_TIMEOUT 5000 // ms without hearing from the highlighter before it is reported unresponsive
+#define HIGHLIGHTER_HUNG_TEXT " Highlighter not responding - using built-in highlighting"
+#define EDIT_LOG_SIZE 1024 // Edits remembered for moving late highlighter replies onto the current text
+#define SPAN_REST (INT_MAX / 2) // Length of a span that runs on to the end of its row
+#define SPANS_TYPE "application/x-sdslh-spans" // Binary HIGHLIGHT bodies - see highlighter_line()
 
 // Scroll position - line and column
 int scroll_line = 0;
 int scroll_col = 0;
 
-typedef struct {
-    int num_rows;
-    char **rows;
-    char **row_syntax; // Syntax highlighting - contains the type of each character corresponding to PAIR_* colours
-} TextBuffer;
-
-// Simple Dummy Highlighter - handles has comments, whitespace, numbers and symbols
-// Highligts the whole buffer
-void highlight_syntax(TextBuffer *buffer) {
-    for (int i = 0; i < buffer->num_rows; i++) {
-        char *row = buffer->rows[i];
-        char *syntax = buffer->row_syntax[i];
-        for (int j = 0; j < strlen(row); j++) {
-            char c = row[j];
-            if (c == '#') {
-                // Make the rest of the line a comment
-                for (int k = j; k < strlen(row); k++) {
-                    syntax[k] = PAIR_COMMENT;
-                }
-                break;
-
-            } else if (isspace(c)) {
-                syntax[j] = PAIR_BODY;
-
-            } else if (isdigit(c)) {
-                syntax[j] = PAIR_NUM;
-
-            } else if (isalpha(c) || c == '_') {
-                syntax[j] = PAIR_VARIABLE;
-
-            } else {
-                syntax[j] = PAIR_OPERATOR;
-            }
-        }
-    }
+// Rows above and below the screen highlighted before it is painted (-p option)
+int highlight_prefetch = HIGHLIGHT_PREFETCH;
+
+// While keys keep coming the screen is redrawn at most once in this many ms (-f option)
+int frame_budget = FRAME_BUDGET;
+
+// Shown in the footer instead of FOOTER_TEXT when set
+char status_message[256];
+
+// Keystroke latency for the footer
+void stats_footer(char *out, size_t size) {
+    const Histogram *key = &stats.histograms[STAT_KEY];
+    snprintf(out, size, "%s  -  key p50 %.2f p99 %.2f ms", FOOTER_TEXT, stat_percentile(key, 50) / 1e6,
+             stat_percentile(key, 99) / 1e6);
 }
 
-void die(const char *s) {
-    endwin();
-    perror(s);
-    exit(EXIT_FAILURE);
-}
-
-void load_file(TextBuffer *buffer, const char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        buffer->num_rows = 1;
-        buffer->rows = malloc(sizeof(char*));
-        buffer->rows[0] = malloc(1);
-        buffer->rows[0][0] = '\0';
-        buffer->row_syntax = malloc(sizeof(char*));
-        buffer->row_syntax[0] = malloc(1);
-        buffer->row_syntax[0][0] = '\0';
-        return;
-    }
-
-    char line[MAX_LINE_LENGTH];
-    buffer->num_rows = 0;
-    buffer->rows = NULL;
-
-    while (fgets(line, sizeof(line), fp)) {
-        buffer->rows = realloc(buffer->rows, sizeof(char*) * (buffer->num_rows + 1));
-        line[strcspn(line, "\n")] = '\0';  // Remove newline character
-        buffer->rows[buffer->num_rows] = strdup(line);
-
-        // Syntax highlighting - all characters are PAIR_BODY by default
-        buffer->row_syntax = realloc(buffer->row_syntax, sizeof(char*) * (buffer->num_rows + 1));
-        buffer->row_syntax[buffer->num_rows] = malloc(strlen(line) + 1);
-        for (int i = 0; i < strlen(line); i++) {
-            buffer->row_syntax[buffer->num_rows][i] = PAIR_BODY;
-        }
-        buffer->row_syntax[buffer->num_rows][strlen(line)] = '\0';
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-        buffer->num_rows++;
-    }
+// What is on the terminal now, so editor_refresh() only has to draw what has changed
+typedef struct {
+    int max_y; // Terminal size the frame was drawn for - 0 until the first paint forces a full redraw
+    int max_x;
+    int scroll_line;
+    int scroll_col;
+    int cursor_x;
+    int cursor_y;
+    long long drawn_at; // now_ms() when it was drawn
+    char *chars; // Body cells, (max_y - 3) rows of max_x
+    char *syntax; // Colour of each body cell, FRAME_STALE if the cell has to be redrawn whatever it holds
+    char *line_chars; // Scratch for building one new body row
+    char *line_syntax;
+    char header[PATH_MAX + sizeof(HEADER_TEXT)]; // The header and footer as drawn, empty when they need drawing
+    char footer[sizeof(status_message)];
+} Frame;
 
-    fclose(fp);
+#define FRAME_STALE (-1)
 
-    strcpy(loaded_filename, filename);
+Frame frame;
 
-    highlight_syntax(buffer);
+// Throw away the previous frame - used when the terminal size changes
+void frame_reset(int max_y, int max_x) {
+    int body_rows = max_y > 3 ? max_y - 3 : 0;
+    size_t cells = (size_t)body_rows * max_x;
+    free(frame.chars);
+    frame.chars = malloc(2 * (cells + max_x) + 2);
+    frame.syntax = frame.chars + cells;
+    frame.line_chars = frame.syntax + cells;
+    frame.line_syntax = frame.line_chars + max_x;
+    memset(frame.syntax, FRAME_STALE, cells);
+    frame.max_y = max_y;
+    frame.max_x = max_x;
+    frame.header[0] = '\0';
+    frame.footer[0] = '\0';
 }
 
-void save_file(TextBuffer *buffer, const char *filename) {
-    FILE *fp = fopen(filename, "w");
-    if (!fp) die("fopen");
+// Move the body up (or down, for a negative lines) with the terminal's own scrolling, so only the rows
+// scrolled into view need drawing
+void frame_scroll(int lines) {
+    int body_rows = frame.max_y - 3;
+    int max_x = frame.max_x;
+    int kept = body_rows - (lines > 0 ? lines : -lines);
 
-    for (int i = 0; i < buffer->num_rows; i++) {
-        fprintf(fp, "%s\n", buffer->rows[i]);
-    }
+    setscrreg(1, body_rows);
+    scrollok(stdscr, TRUE);
+    scrl(lines);
+    scrollok(stdscr, FALSE);
+    setscrreg(0, frame.max_y - 1);
 
-    fclose(fp);
+    if (lines > 0) {
+        memmove(frame.chars, frame.chars + (size_t)lines * max_x, (size_t)kept * max_x);
+        memmove(frame.syntax, frame.syntax + (size_t)lines * max_x, (size_t)kept * max_x);
+        memset(frame.syntax + (size_t)kept * max_x, FRAME_STALE, (size_t)lines * max_x);
+    } else {
+        memmove(frame.chars - (size_t)lines * max_x, frame.chars, (size_t)kept * max_x);
+        memmove(frame.syntax - (size_t)lines * max_x, frame.syntax, (size_t)kept * max_x);
+        memset(frame.syntax, FRAME_STALE, (size_t)-lines * max_x);
+    }
 }
 
-void free_buffer(TextBuffer *buffer) {
-    for (int i = 0; i < buffer->num_rows; i++) {
-        free(buffer->rows[i]);
-        free(buffer->row_syntax[i]);
+// Draw a header/footer line if its text differs from what was drawn last time
+void frame_bar(int y, int colour, char *drawn, size_t drawn_size, const char *text) {
+    if (strcmp(drawn, text) == 0) return;
+    snprintf(drawn, drawn_size, "%s", text);
+
+    attron(COLOR_PAIR(colour));
+    mvprintw(y, 0, "%s", text);
+    // Make the rest of the line the same colour - from wherever the text ended
+    int x = getcurx(stdscr);
+    if (getcury(stdscr) != y) x = frame.max_x;
+    for (int i = x; i < frame.max_x; i++) {
+        addch(' ');
     }
-    free(buffer->rows);
-    free(buffer->row_syntax);
 }
 
 void editor_refresh(TextBuffer *buffer, int cursor_x, int cursor_y) {
-    char line[MAX_LINE_LENGTH];
-    char syntax[MAX_LINE_LENGTH];
-    clear();
+    long long start = stat_start();
     int max_y, max_x;
     getmaxyx(stdscr, max_y, max_x);
 
@@ -146,7 +145,7 @@ void editor_refresh(TextBuffer *buffer, int cursor_x, int cursor_y) {
     if (cursor_y < scroll_line) {
         scroll_line = cursor_y;
     } else if (cursor_y >= scroll_line + max_y - 3) {
-        scroll_line = cursor_y - max_y + 3;
+        scroll_line = cursor_y - max_y + 4;
     }
 
     // Scroll position if necessary - column
@@ -156,94 +155,951 @@ void editor_refresh(TextBuffer *buffer, int cursor_x, int cursor_y) {
         scroll_col = cursor_x - max_x + 1;
     }
 
-    // Header
-    attron(COLOR_PAIR(PAIR_HEADER));
-    mvprintw(0, 0, HEADER_TEXT, loaded_filename);
-    // Make the rest of the header the same colour
-    for (int i = (int)strlen(loaded_filename); i < max_x; i++) {
-        addch(' ');
+    buffer->view_start = scroll_line;
+    buffer->view_end = scroll_line + max_y - 3;
+
+    // Highlight what is about to be shown (plus the prefetch margin) if the catch-up pass has not got there yet
+    highlight_visible(buffer, scroll_line - highlight_prefetch, scroll_line + max_y - 3 + highlight_prefetch);
+
+    char header[sizeof(frame.header)];
+    snprintf(header, sizeof(header), HEADER_TEXT, buffer->filename);
+    char footer[sizeof(status_message)] = FOOTER_TEXT;
+    if (stats.enabled) stats_footer(footer, sizeof(footer));
+    const char *footer_shown = status_message[0] ? status_message : footer;
+
+    // Nothing is drawn if nothing on screen would change - the rows edited or highlighted since the last
+    // frame are all off it, and the cursor, the scroll position and the bars are as they were
+    int body_rows = max_y - 3;
+    int rows_changed = buffer->changed_start >= 0 && buffer->changed_start < scroll_line + body_rows &&
+                       (buffer->changed_rows || buffer->changed_end >= scroll_line);
+    if (!rows_changed && max_y == frame.max_y && max_x == frame.max_x && scroll_line == frame.scroll_line &&
+        scroll_col == frame.scroll_col && cursor_x == frame.cursor_x && cursor_y == frame.cursor_y &&
+        strcmp(header, frame.header) == 0 && strcmp(footer_shown, frame.footer) == 0) return;
+    buffer->changed_start = -1;
+
+    if (max_y != frame.max_y || max_x != frame.max_x) {
+        // New terminal size - start again from a blank screen
+        frame_reset(max_y, max_x);
+        clear();
+    } else if (scroll_col == frame.scroll_col && scroll_line != frame.scroll_line &&
+               abs(scroll_line - frame.scroll_line) < body_rows) {
+        frame_scroll(scroll_line - frame.scroll_line);
     }
+    frame.scroll_line = scroll_line;
+    frame.scroll_col = scroll_col;
+
+    // Header
+    frame_bar(0, PAIR_HEADER, frame.header, sizeof(frame.header), header);
 
-    // Body
-    attron(COLOR_PAIR(PAIR_BODY));
-    for (int i = 0; i < buffer->num_rows && i < max_y - 3; i++) {
-        // copy the buffer to the line taking into account the scroll position
-        strncpy(line, buffer->rows[i + scroll_line] + scroll_col, max_x);
-        line[max_x] = '\0';
-        strncpy(syntax, buffer->row_syntax[i + scroll_line] + scroll_col, max_x);
-        syntax[max_x] = '\0';
-        // Position cursor at the beginning of the line
-        move(i + 1, 0);
-        // print the line with syntax highlighting
-        for (int j = 0; j < max_x; j++) {
-            if (line[j] == '\0') break;
-            int colour = (int)syntax[j];
-            if (!colour) colour = PAIR_BODY;
-            attron(COLOR_PAIR(colour));
-            addch(line[j]);
+    // Body - only the span of each row that differs from the last frame is drawn
+    for (int i = 0; i < body_rows; i++) {
+        char *line = frame.line_chars;
+        char *syntax = frame.line_syntax;
+        int len = 0;
+        if (i + scroll_line < buffer->num_rows) {
+            // the part of the line visible taking into account the scroll position
+            Row *row = buffer_row(buffer, i + scroll_line);
+            row_flatten(row);
+            len = row->len - scroll_col;
+            if (len < 0) len = 0;
+            if (len > max_x) len = max_x;
+            if (len) {
+                memcpy(line, row->chars + scroll_col, len);
+                row_colours(row, scroll_col, syntax, len);
+            }
         }
-        // Clear the rest of the line
-        attron(COLOR_PAIR(PAIR_BODY));
-        for (int j = strlen(line); j < max_x; j++) {
-            addch(' ');
+        // The rest of the line is blank
+        memset(line + len, ' ', max_x - len);
+        memset(syntax + len, PAIR_BODY, max_x - len);
+        for (int j = 0; j < len; j++) {
+            // Every character takes exactly one cell - addnstr() would stop at a NUL and expand other controls
+            if (!isprint((unsigned char)line[j])) line[j] = line[j] == '\t' ? ' ' : '?';
         }
 
+        char *drawn = frame.chars + (size_t)i * max_x;
+        char *drawn_syntax = frame.syntax + (size_t)i * max_x;
+        int first = 0;
+        while (first < max_x && line[first] == drawn[first] && syntax[first] == drawn_syntax[first]) first++;
+        if (first == max_x) continue;
+        int last = max_x - 1;
+        while (line[last] == drawn[last] && syntax[last] == drawn_syntax[last]) last--;
+
+        // Position cursor at the start of the change and print it with syntax highlighting,
+        // one attribute change and one write for each run of characters of the same colour
+        move(i + 1, first);
+        for (int j = first; j <= last;) {
+            int run_end = j + 1;
+            while (run_end <= last && syntax[run_end] == syntax[j]) run_end++;
+            attron(COLOR_PAIR((int)syntax[j]));
+            addnstr(line + j, run_end - j);
+            j = run_end;
+        }
+        memcpy(drawn + first, line + first, last - first + 1);
+        memcpy(drawn_syntax + first, syntax + first, last - first + 1);
     }
 
     // Footer
-    attron(COLOR_PAIR(PAIR_FOOTER));
-    mvprintw(max_y - 1, 0, "%s", FOOTER_TEXT);
-    // Make the rest of the header the same colour
-    for (int i = (int)strlen(FOOTER_TEXT); i < max_x; i++) {
-        addch(' ');
-    }
+    frame_bar(max_y - 1, PAIR_FOOTER, frame.footer, sizeof(frame.footer), footer_shown);
 
     move(cursor_y + 1 - scroll_line, cursor_x - scroll_col);
     refresh();
+    frame.cursor_x = cursor_x;
+    frame.cursor_y = cursor_y;
+    frame.drawn_at = now_ms();
+    stat_record(STAT_RENDER, start);
+}
+
+// An edit, remembered so replies to requests made before it can be moved to fit the text after it
+typedef struct {
+    int version; // The document version the edit made
+    int y0; // The range replaced
+    int x0;
+    int y1;
+    int x1;
+    int end_y; // Where the replacement text ends
+    int end_x;
+} Edit;
+
+// A run of one colour from a line of a HIGHLIGHT reply, now at (y, x)
+typedef struct {
+    int y;
+    int x;
+    int len;
+    char pair;
+} Span;
+
+// Connection to an out-of-process SDSLH highlighter, talking over its stdin/stdout.
+// Nothing here ever blocks - messages are queued and written as the pipe accepts them.
+typedef struct {
+    pid_t pid; // 0 when there is no highlighter process
+    int to_fd; // The highlighter's stdin, non-blocking
+    int from_fd; // The highlighter's stdout, non-blocking
+    char *out; // Messages waiting to be written
+    size_t out_len;
+    size_t out_cap;
+    char *in; // Bytes read but not yet parsed into messages
+    size_t in_len;
+    size_t in_cap;
+    char resource[PATH_MAX]; // The document, as named in the request lines
+    int version; // Bumped by every edit and sent as the Timestamp, so stale replies can be recognised
+    int req_version; // What the last HIGHLIGHT request sent was for
+    int req_start;
+    int req_end;
+    int want_start; // Rows wanted by a HIGHLIGHT not yet sent (-1 for none) - a newer request replaces it
+    int want_end;
+    int delta_pending; // An edit not yet sent, which later edits next to it are merged into
+    int delta_y0; // The range it replaces, in the highlighter's coordinates
+    int delta_x0;
+    int delta_y1;
+    int delta_x1;
+    int delta_end_y; // Where its text ends, in the editor's coordinates
+    int delta_end_x;
+    char *delta_text;
+    size_t delta_len;
+    size_t delta_cap;
+    Edit edits[EDIT_LOG_SIZE]; // Every edit after edit_base, oldest first, from edit_first round the ring
+    int edit_first;
+    int edit_count;
+    int edit_base; // Replies for versions before this are too old to move and are dropped
+    Span *spans; // Scratch for moving a reply line, two lists of span_cap each
+    int span_cap;
+    int span_count; // In the first list
+    long long last_heard; // When anything last arrived from the highlighter (ms)
+    int hung; // Not heard from in HIGHLIGHTER_TIMEOUT - no PINGs or HIGHLIGHTs are sent until it is again
+    long long last_ping; // When the last PING was sent (ms)
+    long long req_sent; // stat_start() when the last HIGHLIGHT was sent, 0 once its reply is in
+} Highlighter;
+
+Highlighter highlighter;
+
+// Highlight classes in text/plain HIGHLIGHT bodies - one letter per character, one line per row
+const char HIGHLIGHT_CLASSES[] = "bcksnove";
+const char HIGHLIGHT_PAIRS[] = {PAIR_BODY, PAIR_COMMENT, PAIR_KEYWORD, PAIR_STRING, PAIR_NUM, PAIR_OPERATOR,
+                                PAIR_VARIABLE, PAIR_ERROR};
+
+char pair_for_class(char class) {
+    const char *p = class ? strchr(HIGHLIGHT_CLASSES, class) : NULL;
+    return p ? HIGHLIGHT_PAIRS[p - HIGHLIGHT_CLASSES] : PAIR_BODY;
+}
+
+void highlighter_queue(const char *data, size_t len) {
+    if (highlighter.out_len + len > highlighter.out_cap) {
+        highlighter.out_cap = (highlighter.out_len + len) * 2;
+        highlighter.out = realloc(highlighter.out, highlighter.out_cap);
+    }
+    memcpy(highlighter.out + highlighter.out_len, data, len);
+    highlighter.out_len += len;
+}
+
+// Queue the request line and headers of a message - extra_headers is printf style and may be empty.
+// The body, body_len bytes of it, must be queued straight after.
+void highlighter_header(const char *command, size_t body_len, const char *extra_headers, ...) {
+    char header[PATH_MAX + 256];
+    int n = snprintf(header, sizeof(header), "%s %s SDSLH/1.0\nTimestamp: %d\n", command, highlighter.resource,
+                     highlighter.version);
+    va_list args;
+    va_start(args, extra_headers);
+    n += vsnprintf(header + n, sizeof(header) - n, extra_headers, args);
+    va_end(args);
+    if (body_len) n += snprintf(header + n, sizeof(header) - n, "Content-Length: %zu\n", body_len);
+    n += snprintf(header + n, sizeof(header) - n, "\n");
+    highlighter_queue(header, n);
+}
+
+// The highlighter has gone away - carry on with the built-in highlighter
+void highlighter_lost(const char *why) {
+    close(highlighter.to_fd);
+    close(highlighter.from_fd);
+    waitpid(highlighter.pid, NULL, WNOHANG);
+    highlighter.pid = 0;
+    highlighter.out_len = 0;
+    highlighter.in_len = 0;
+    highlighter.delta_pending = 0;
+    highlighter.want_start = -1;
+    highlighter.edit_count = 0;
+    snprintf(status_message, sizeof(status_message), " %s - using built-in highlighting", why);
 }
 
-void insert_char(TextBuffer *buffer, int x, int y, int c) {
-    char *row = buffer->rows[y];
-    int len = strlen(row);
+// Launch the highlighter with sh -c so the command can have arguments
+void highlighter_start(const char *command, const char *filename) {
+    int to_child[2], from_child[2];
+    if (pipe(to_child) != 0 || pipe(from_child) != 0) die("pipe");
 
-    if (x > len) x = len;
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+    if (pid == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        // Anything on stderr would scribble over the screen
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) dup2(null_fd, STDERR_FILENO);
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        _exit(127);
+    }
+
+    close(to_child[0]);
+    close(from_child[1]);
+    highlighter.pid = pid;
+    highlighter.to_fd = to_child[1];
+    highlighter.from_fd = from_child[0];
+    fcntl(highlighter.to_fd, F_SETFL, O_NONBLOCK);
+    fcntl(highlighter.from_fd, F_SETFL, O_NONBLOCK);
+    fcntl(highlighter.to_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(highlighter.from_fd, F_SETFD, FD_CLOEXEC);
+    highlighter.req_version = -1;
+    highlighter.want_start = -1;
+    highlighter.last_heard = highlighter.last_ping = now_ms();
+    highlighter.hung = 0;
+
+    // The resource is the file name as an absolute-looking path, with spaces escaped
+    size_t n = 0;
+    if (filename[0] != '/') highlighter.resource[n++] = '/';
+    for (const char *p = filename; *p && n + 4 < sizeof(highlighter.resource); p++) {
+        if (*p == ' ') {
+            memcpy(highlighter.resource + n, "%20", 3);
+            n += 3;
+        } else {
+            highlighter.resource[n++] = *p;
+        }
+    }
+    highlighter.resource[n] = '\0';
+}
+
+// Send the whole document so the highlighter's copy starts in step
+void highlighter_init(TextBuffer *buffer) {
+    if (!highlighter.pid) return;
+    size_t len = 0;
+    for (int i = 0; i < buffer->num_rows; i++) len += buffer_row(buffer, i)->len + 1;
+    // Offer the binary span format for HIGHLIGHT bodies - the Content-Type of each reply says which it got
+    highlighter_header("INIT", len, "Content-Type: text/plain\nAccept: " SPANS_TYPE ", text/plain\n");
+    for (int i = 0; i < buffer->num_rows; i++) {
+        Row *row = buffer_row(buffer, i);
+        row_flatten(row);
+        highlighter_queue(row->chars, row->len);
+        highlighter_queue("\n", 1);
+    }
+}
+
+// Where n characters of text end when inserted at (y, x)
+void text_end(const char *text, size_t n, int y, int x, int *end_y, int *end_x) {
+    size_t last = 0;
+    int lines = 0;
+    for (const char *p = text; (p = memchr(p, '\n', text + n - p)); p++) {
+        lines++;
+        last = p - text + 1;
+    }
+    *end_y = y + lines;
+    *end_x = lines ? (int)(n - last) : x + (int)n;
+}
+
+// Offset into the pending edit's text of (y, x), which must lie within it. Found by counting back from
+// the end of the text, since the next edit is nearly always close to where the last one finished.
+size_t delta_offset(int y, int x) {
+    const char *text = highlighter.delta_text;
+    size_t offset = highlighter.delta_len;
+    int row = highlighter.delta_end_y;
+    int column = highlighter.delta_end_x;
+    while (row > y) {
+        // Back to the newline ending the row before, then back again to find that newline's column
+        offset -= column + 1;
+        size_t start = offset;
+        while (start > 0 && text[start - 1] != '\n') start--;
+        column = (int)(offset - start) + (start ? 0 : highlighter.delta_x0);
+        row--;
+    }
+    return offset - (column - x);
+}
+
+void highlighter_send_delta(void) {
+    if (!highlighter.delta_pending) return;
+    highlighter_header("DELTA", highlighter.delta_len, "Range: %d:%d-%d:%d\nContent-Type: text/plain\n",
+                       highlighter.delta_y0, highlighter.delta_x0, highlighter.delta_y1, highlighter.delta_x1);
+    highlighter_queue(highlighter.delta_text, highlighter.delta_len);
+    highlighter.delta_pending = 0;
+}
+
+// Merge an edit into the pending one if the two touch or overlap, returns false if they do not
+int highlighter_merge(int y0, int x0, int y1, int x1, const char *text, int n) {
+    Highlighter *h = &highlighter;
+    // The edit must start no later than the pending text ends, and end no earlier than it starts
+    if (y0 > h->delta_end_y || (y0 == h->delta_end_y && x0 > h->delta_end_x)) return 0;
+    if (y1 < h->delta_y0 || (y1 == h->delta_y0 && x1 < h->delta_x0)) return 0;
+
+    int starts_before = y0 < h->delta_y0 || (y0 == h->delta_y0 && x0 < h->delta_x0);
+    int ends_after = y1 > h->delta_end_y || (y1 == h->delta_end_y && x1 > h->delta_end_x);
+    size_t from = starts_before ? 0 : delta_offset(y0, x0);
+    size_t to = ends_after ? h->delta_len : delta_offset(y1, x1);
+
+    // Where the pending text now ends - just past the new text, or where its old end has moved to
+    int new_end_y, new_end_x;
+    text_end(text, n, y0, x0, &new_end_y, &new_end_x);
+    if (!ends_after) {
+        new_end_x = h->delta_end_y == y1 ? new_end_x + h->delta_end_x - x1 : h->delta_end_x;
+        new_end_y += h->delta_end_y - y1;
+    }
+
+    // Text either side of the pending text was not in the range it replaces, so widen the range over it.
+    // Before the pending text the two coordinate systems agree; after it they differ by the pending edit.
+    if (ends_after) {
+        if (y1 == h->delta_end_y) h->delta_x1 += x1 - h->delta_end_x;
+        else h->delta_x1 = x1;
+        h->delta_y1 += y1 - h->delta_end_y;
+    }
+    if (starts_before) {
+        h->delta_y0 = y0;
+        h->delta_x0 = x0;
+    }
 
-    row = realloc(row, len + 2);  // +1 for new char, +1 for null terminator
-    memmove(&row[x + 1], &row[x], len - x + 1);
-    row[x] = c;
-    buffer->rows[y] = row;
+    size_t len = from + n + (h->delta_len - to);
+    if (len > h->delta_cap) {
+        h->delta_cap = len * 2;
+        h->delta_text = realloc(h->delta_text, h->delta_cap);
+    }
+    memmove(h->delta_text + from + n, h->delta_text + to, h->delta_len - to);
+    memcpy(h->delta_text + from, text, n);
+    h->delta_len = len;
+    h->delta_end_y = new_end_y;
+    h->delta_end_x = new_end_x;
+    return 1;
+}
 
-    // Syntax highlighting - all characters are the same as the previous character by default
-    char *syntax = buffer->row_syntax[y];
-    syntax = realloc(syntax, len + 2);
-    memmove(&syntax[x + 1], &syntax[x], len - x + 1);
-    syntax[x] = syntax[x - 1];
-    buffer->row_syntax[y] = syntax;
+// Remember an edit until every reply that predates it has arrived - when the log is full the oldest edit is
+// forgotten, along with any chance of moving replies older than it
+void highlighter_log(int y0, int x0, int y1, int x1, const char *text, int n) {
+    if (highlighter.edit_count == EDIT_LOG_SIZE) {
+        highlighter.edit_base = highlighter.edits[highlighter.edit_first].version;
+        highlighter.edit_first = (highlighter.edit_first + 1) % EDIT_LOG_SIZE;
+        highlighter.edit_count--;
+    }
+    Edit *edit = &highlighter.edits[(highlighter.edit_first + highlighter.edit_count++) % EDIT_LOG_SIZE];
+    edit->version = highlighter.version;
+    edit->y0 = y0;
+    edit->x0 = x0;
+    edit->y1 = y1;
+    edit->x1 = x1;
+    text_end(text, n, y0, x0, &edit->end_y, &edit->end_x);
 }
 
-void delete_char(TextBuffer *buffer, int x, int y) {
-    char *row = buffer->rows[y];
-    int len = strlen(row);
+// A reply for this version has arrived, so no later one can be older - forget the edits it already includes
+void highlighter_forget(int version) {
+    while (highlighter.edit_count && highlighter.edits[highlighter.edit_first].version <= version) {
+        highlighter.edit_first = (highlighter.edit_first + 1) % EDIT_LOG_SIZE;
+        highlighter.edit_count--;
+    }
+    if (version > highlighter.edit_base) highlighter.edit_base = version;
+}
 
-    if (x <= 0 || x > len) return;
+// Tell the highlighter that the text from (y0, x0) up to (y1, x1) has been replaced with n characters of
+// text. Edits are held back and merged while they keep touching, so typing, auto-repeat and paste go out
+// as a few DELTAs rather than one per key.
+void highlighter_delta(int y0, int x0, int y1, int x1, const char *text, int n) {
+    if (!highlighter.pid) return;
+    if (highlighter.delta_pending && !highlighter_merge(y0, x0, y1, x1, text, n)) highlighter_send_delta();
+    highlighter.version++;
+    highlighter_log(y0, x0, y1, x1, text, n);
+    if (highlighter.delta_pending) return;
 
-    memmove(&row[x - 1], &row[x], len - x + 1);
-    memmove(&buffer->row_syntax[y][x - 1], &buffer->row_syntax[y][x], len - x + 1);
+    highlighter.delta_pending = 1;
+    highlighter.delta_y0 = y0;
+    highlighter.delta_x0 = x0;
+    highlighter.delta_y1 = y1;
+    highlighter.delta_x1 = x1;
+    if ((size_t)n >= highlighter.delta_cap) {
+        highlighter.delta_cap = n * 2 + 64;
+        highlighter.delta_text = realloc(highlighter.delta_text, highlighter.delta_cap);
+    }
+    memcpy(highlighter.delta_text, text, n);
+    highlighter.delta_len = n;
+    text_end(text, n, y0, x0, &highlighter.delta_end_y, &highlighter.delta_end_x);
 }
 
+// Ask for rows start..end (inclusive) unless the last request already covers them at this version. The
+// request waits for the next flush, and is replaced by any newer one made before then.
+void highlighter_request(TextBuffer *buffer, int start, int end) {
+    if (!highlighter.pid) return;
+    if (start < 0) start = 0;
+    if (end >= buffer->num_rows) end = buffer->num_rows - 1;
+    highlighter.want_start = -1;
+    if (highlighter.req_version == highlighter.version && start >= highlighter.req_start &&
+        end <= highlighter.req_end) return;
+    highlighter.want_start = start;
+    highlighter.want_end = end;
+}
+
+// Send the held back edit and HIGHLIGHT request, once everything before them has been written. Nothing
+// waits for an ACK - the edit and the request go out back to back.
+void highlighter_flush(void) {
+    if (highlighter.out_len) return;
+    highlighter_send_delta();
+    // A hung highlighter still gets the edits, so its text is right when it comes back, but the request
+    // waits until then
+    if (highlighter.want_start < 0 || highlighter.hung) return;
+    highlighter.req_version = highlighter.version;
+    highlighter.req_start = highlighter.want_start;
+    highlighter.req_end = highlighter.want_end;
+    highlighter_header("HIGHLIGHT", 0, "Range: %d:0-%d:0\nVisible: %d:0-%d:0\n", highlighter.want_start,
+                       highlighter.want_end + 1, scroll_line, scroll_line + LINES - 2);
+    highlighter.want_start = -1;
+    highlighter.req_sent = stat_start();
+}
+
+// Move a line of a reply through an edit - the part before the range replaced stays put, the part inside it
+// goes, and the part after it moves with the end of the replacement text. Returns the number of spans in out.
+int edit_spans(const Edit *edit, const Span *in, int n, Span *out) {
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        Span span = in[i];
+        // Columns of this line before the range and from the end of the range on
+        int cut0 = span.y < edit->y0 ? INT_MAX : span.y == edit->y0 ? edit->x0 : INT_MIN;
+        int cut1 = span.y > edit->y1 ? INT_MIN : span.y == edit->y1 ? edit->x1 : INT_MAX;
+        int end = span.x + span.len;
+        if (span.x < cut0) {
+            out[count] = span;
+            out[count++].len = (end < cut0 ? end : cut0) - span.x;
+        }
+        int x = span.x > cut1 ? span.x : cut1;
+        if (x < end) {
+            out[count].pair = span.pair;
+            out[count].len = end - x;
+            out[count].y = span.y == edit->y1 ? edit->end_y : span.y + edit->end_y - edit->y1;
+            out[count++].x = span.y == edit->y1 ? edit->end_x + x - edit->x1 : x;
+        }
+    }
+    return count;
+}
+
+void highlighter_span(int y, int x, int len, char pair) {
+    if (highlighter.span_count == highlighter.span_cap) {
+        // The second list moves up, but it is only used once this one is complete
+        highlighter.span_cap = highlighter.span_cap * 2 + 64;
+        highlighter.spans = realloc(highlighter.spans, sizeof(Span) * highlighter.span_cap * 2);
+    }
+    highlighter.spans[highlighter.span_count++] = (Span){y, x, len, pair};
+}
+
+// Read an unsigned LEB128 varint, returns NULL if the body ends in the middle of it
+const char *read_varint(const char *p, const char *end, unsigned *value) {
+    *value = 0;
+    for (int shift = 0; p < end && shift < 32; shift += 7) {
+        unsigned char byte = *p++;
+        *value |= (unsigned)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return p;
+    }
+    return NULL;
+}
+
+// Split the next line of a HIGHLIGHT body, for row y, into spans of one colour. Returns where the next
+// line starts, or NULL at the end of the body.
+//
+// A text/plain line is a letter per character ending in a newline. An application/x-sdslh-spans line is
+// varints - length, gap, class for each token, where gap is the columns since the last token ended and class
+// indexes HIGHLIGHT_CLASSES - ending in a length of 0. Columns not in a token, to the end of the row, are body.
+// The highlighter is not trusted to keep its tokens within the row, max_x columns long, and a line with one
+// that runs past it is dropped, leaving the row's colours as they were.
+const char *highlighter_line(const char *p, const char *end, int binary, int y, int max_x) {
+    highlighter.span_count = 0;
+    if (p >= end) return NULL;
+    if (!binary) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) nl = end;
+        for (const char *run = p; run < nl;) {
+            const char *run_end = run + 1;
+            while (run_end < nl && *run_end == *run) run_end++;
+            highlighter_span(y, (int)(run - p), (int)(run_end - run), pair_for_class(*run));
+            run = run_end;
+        }
+        return nl + 1;
+    }
+
+    int x = 0;
+    int bad = 0;
+    unsigned len, gap, class;
+    while ((p = read_varint(p, end, &len)) && len) {
+        if (!(p = read_varint(p, end, &gap)) || !(p = read_varint(p, end, &class))) return NULL;
+        // Checked separately so the sum cannot wrap - the rest of the line is still read to find the next
+        if (bad || gap > (unsigned)(max_x - x) || len > (unsigned)(max_x - x) - gap) {
+            bad = 1;
+            continue;
+        }
+        if (gap) highlighter_span(y, x, (int)gap, PAIR_BODY);
+        x += (int)gap;
+        highlighter_span(y, x, (int)len, class < sizeof(HIGHLIGHT_PAIRS) ? HIGHLIGHT_PAIRS[class] : PAIR_BODY);
+        x += (int)len;
+    }
+    if (bad) highlighter.span_count = 0;
+    else highlighter_span(y, x, SPAN_REST, PAIR_BODY);
+    return p;
+}
+
+// Colour rows from a HIGHLIGHT body for the given version, starting at row y. A body for an older version
+// is moved through the edits made since, so it still lines up with the text on screen.
+int highlighter_apply(TextBuffer *buffer, int version, int y, const char *body, size_t len, int binary) {
+    int first = highlighter.edit_count - (highlighter.version - version);
+    const char *end = body + len;
+    int changed = 0;
+    // A row's length is only known for a reply to the text as it is now
+    for (const char *p = body;; y++) {
+        int max_x = version == highlighter.version && y < buffer->num_rows ? buffer_row(buffer, y)->len : SPAN_REST;
+        if (!(p = highlighter_line(p, end, binary, y, max_x))) break;
+        // Each edit splits at most one span in two
+        int n = highlighter.span_count;
+        if (highlighter.span_cap < n + highlighter.edit_count - first) {
+            highlighter.span_cap = (n + highlighter.edit_count - first) * 2;
+            highlighter.spans = realloc(highlighter.spans, sizeof(Span) * highlighter.span_cap * 2);
+        }
+        Span *spans = highlighter.spans;
+        Span *spare = highlighter.spans + highlighter.span_cap;
+        for (int i = first; i < highlighter.edit_count && n; i++) {
+            n = edit_spans(&highlighter.edits[(highlighter.edit_first + i) % EDIT_LOG_SIZE], spans, n, spare);
+            Span *swap = spans;
+            spans = spare;
+            spare = swap;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (spans[i].y >= buffer->num_rows) continue;
+            Row *row = buffer_row(buffer, spans[i].y);
+            if (spans[i].x >= row->len) continue;
+            int count = row->len - spans[i].x < spans[i].len ? row->len - spans[i].x : spans[i].len;
+            row_paint(&buffer->arena, row, spans[i].x, count, spans[i].pair);
+            mark_changed(buffer, spans[i].y, spans[i].y);
+            row->remote = 1;
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// Find the end of a message's headers - the offset just past the blank line, or 0 if it has not all arrived
+size_t header_end(const char *p, size_t n) {
+    for (size_t i = 0; i + 1 < n; i++) {
+        if (p[i] != '\n') continue;
+        if (p[i + 1] == '\n') return i + 2;
+        if (p[i + 1] == '\r' && i + 2 < n && p[i + 2] == '\n') return i + 3;
+    }
+    return 0;
+}
+
+// Handle one message from the highlighter, returns true if any row colours changed
+int highlighter_message(TextBuffer *buffer, const char *command, int version, int range_line, int binary,
+                        const char *body, size_t body_len) {
+    if (strcmp(command, "HIGHLIGHT") == 0) {
+        // A reply to a request made before edits that have been forgotten cannot be lined up with the text
+        if (version < highlighter.edit_base || version > highlighter.version || range_line < 0) return 0;
+        if (version == highlighter.req_version && range_line == highlighter.req_start) {
+            stat_record(STAT_HIGHLIGHTER, highlighter.req_sent);
+            highlighter.req_sent = 0;
+        }
+        return highlighter_apply(buffer, version, range_line, body, body_len, binary);
+    }
+    if (strcmp(command, "ERROR") == 0) {
+        int n = (int)body_len;
+        const char *nl = memchr(body, '\n', body_len);
+        if (nl) n = (int)(nl - body);
+        snprintf(status_message, sizeof(status_message), " Highlighter: %.*s", n, body);
+    }
+    // ACK and PING replies only show the highlighter is alive
+    return 0;
+}
+
+// Parse and handle every complete message that has arrived, returns true if any row colours changed
+int highlighter_parse(TextBuffer *buffer) {
+    int changed = 0;
+    size_t pos = 0;
+    while (pos < highlighter.in_len) {
+        char *msg = highlighter.in + pos;
+        size_t avail = highlighter.in_len - pos;
+        size_t headers = header_end(msg, avail);
+        if (!headers) break;
+
+        char command[32] = "";
+        int version = -1, range_line = -1, binary = 0;
+        size_t body_len = 0;
+        sscanf(msg, "%31s", command);
+        for (char *line = memchr(msg, '\n', headers); line && line < msg + headers - 1;
+             line = memchr(line, '\n', msg + headers - line)) {
+            line++;
+            // The input is not NUL terminated, so only look as far as the end of the line
+            const char *end = memchr(line, '\n', msg + headers - line);
+            size_t line_len = end ? (size_t)(end - line) : 0;
+            if (strncasecmp(line, "Content-Length:", 15) == 0) body_len = strtoul(line + 15, NULL, 10);
+            else if (strncasecmp(line, "Timestamp:", 10) == 0) version = atoi(line + 10);
+            else if (line_len > 6 && strncasecmp(line, "Range:", 6) == 0 && memchr(line + 6, ':', line_len - 6)) {
+                // Only line:column ranges can be lined up with the rows
+                range_line = atoi(line + 6);
+            } else if (strncasecmp(line, "Content-Type:", 13) == 0) {
+                binary = strncasecmp(line + 13 + strspn(line + 13, " "), SPANS_TYPE, sizeof(SPANS_TYPE) - 1) == 0;
+            }
+        }
+        if (avail - headers < body_len) break;
+
+        changed |= highlighter_message(buffer, command, version, range_line, binary, msg + headers, body_len);
+        if (version >= 0) highlighter_forget(version);
+        pos += headers + body_len;
+    }
+    memmove(highlighter.in, highlighter.in + pos, highlighter.in_len - pos);
+    highlighter.in_len -= pos;
+    return changed;
+}
+
+// Move whatever the pipes will take in either direction without blocking, returns true if the screen needs
+// repainting - row colours changed or there is a new status message
+int highlighter_pump(TextBuffer *buffer) {
+    if (!highlighter.pid) return 0;
+    long long now = now_ms();
+
+    highlighter_flush();
+    // Keep checking the highlighter is responsive while there is nothing else to say to it
+    if (now - highlighter.last_ping >= HIGHLIGHTER_PING_INTERVAL && highlighter.out_len == 0 && !highlighter.hung) {
+        highlighter_header("PING", 0, "");
+        highlighter.last_ping = now;
+    }
+
+    while (highlighter.out_len) {
+        ssize_t n = write(highlighter.to_fd, highlighter.out, highlighter.out_len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) break;
+            highlighter_lost("Highlighter exited");
+            return 1;
+        }
+        memmove(highlighter.out, highlighter.out + n, highlighter.out_len - n);
+        highlighter.out_len -= n;
+    }
+
+    int changed = 0;
+    while (1) {
+        if (highlighter.in_cap - highlighter.in_len < 4096) {
+            highlighter.in_cap = highlighter.in_cap * 2 + 4096;
+            highlighter.in = realloc(highlighter.in, highlighter.in_cap);
+        }
+        ssize_t n = read(highlighter.from_fd, highlighter.in + highlighter.in_len, highlighter.in_cap - highlighter.in_len);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            highlighter_lost("Highlighter exited");
+            return 1;
+        }
+        if (n < 0) break;
+        highlighter.in_len += n;
+        highlighter.last_heard = now;
+        if (highlighter.hung) {
+            // Back - send what has been held back, and take down the message if it is still up
+            highlighter.hung = 0;
+            if (strcmp(status_message, HIGHLIGHTER_HUNG_TEXT) == 0) status_message[0] = '\0';
+            highlighter_flush();
+            changed = 1;
+        }
+        changed |= highlighter_parse(buffer);
+    }
+
+    // Said once, so a key dismisses it like any other message
+    if (!highlighter.hung && now - highlighter.last_heard > HIGHLIGHTER_TIMEOUT) {
+        highlighter.hung = 1;
+        snprintf(status_message, sizeof(status_message), "%s", HIGHLIGHTER_HUNG_TEXT);
+        changed = 1;
+    }
+    return changed;
+}
+
+void highlighter_stop(void) {
+    if (!highlighter.pid) return;
+    // Closing its stdin asks the highlighter to finish
+    close(highlighter.to_fd);
+    close(highlighter.from_fd);
+    if (waitpid(highlighter.pid, NULL, WNOHANG) == 0) {
+        kill(highlighter.pid, SIGTERM);
+        waitpid(highlighter.pid, NULL, 0);
+    }
+    highlighter.pid = 0;
+    free(highlighter.out);
+    free(highlighter.in);
+    free(highlighter.delta_text);
+    free(highlighter.spans);
+}
+
+// Wait for the save in progress, if there is one, and say how it went in the status bar. Returns true if
+// there was one.
+int save_report(TextBuffer *buffer) {
+    if (!save_finish(buffer)) return 0;
+    if (buffer->saver.failed) {
+        snprintf(status_message, sizeof(status_message), " Save failed - %s: %s", buffer->saver.failed,
+                 strerror(buffer->saver.error));
+    } else {
+        snprintf(status_message, sizeof(status_message), "%s", " File saved.");
+    }
+    return 1;
+}
+
+void restore_terminal(void) {
+    endwin();
+}
+
+// Wait for a key. The time until it arrives goes on the highlighter's pipes and on highlighting the
+// rest of the buffer in bounded chunks - when there is nothing left to do it sleeps in poll().
+int editor_getch(TextBuffer *buffer, int cursor_x, int cursor_y) {
+    int c;
+    timeout(0);
+    while ((c = getch()) == ERR) {
+        int repaint = highlighter_pump(buffer);
+        repaint |= highlight_worker_collect(buffer);
+
+        int catching_up = buffer->hl_valid < buffer->num_rows;
+        if (catching_up) {
+            int first = buffer->hl_valid;
+            highlight_catch_up(buffer, HIGHLIGHT_CHUNK);
+            // Repaint if the chunk may have corrected rows that are on screen
+            if (first < scroll_line + LINES - 3 && buffer->hl_valid > scroll_line) repaint = 1;
+        }
+        if (repaint) editor_refresh(buffer, cursor_x, cursor_y);
+        if (catching_up && !buffer->prehighlight.waiting) continue;
+
+        struct pollfd fds[6] = {{STDIN_FILENO, POLLIN, 0}};
+        int nfds = 1;
+        int wait = -1;
+        // Wake up to say the save in progress is done
+        if (buffer->saver.running) fds[nfds++] = (struct pollfd){buffer->saver.wake[0], POLLIN, 0};
+        if (buffer->num_jobs_sent) fds[nfds++] = (struct pollfd){buffer->worker.wake[0], POLLIN, 0};
+        // Wake up when a parallel highlighting thread finishes a chunk
+        if (buffer->prehighlight.waiting) fds[nfds++] = (struct pollfd){buffer->prehighlight.wake[0], POLLIN, 0};
+        if (highlighter.pid) {
+            fds[nfds++] = (struct pollfd){highlighter.from_fd, POLLIN, 0};
+            if (highlighter.out_len) fds[nfds++] = (struct pollfd){highlighter.to_fd, POLLOUT, 0};
+            // Wake up in time for the next PING
+            wait = HIGHLIGHTER_PING_INTERVAL;
+        }
+        poll(fds, nfds, wait);
+        if (buffer->saver.running && fds[1].revents & POLLIN && save_report(buffer)) editor_refresh(buffer, cursor_x, cursor_y);
+        if (buffer->prehighlight.waiting) {
+            char drain[64];
+            while (read(buffer->prehighlight.wake[0], drain, sizeof(drain)) > 0) continue;
+        }
+    }
+    timeout(-1);
+    return c;
+}
+
+// Do what key c does to the buffer and the cursor - returns false if it quits
+int editor_key(TextBuffer *buffer, const char *filename, int c, int *cursor_x, int *cursor_y) {
+    int x = *cursor_x;
+    int y = *cursor_y;
+    // Any key dismisses a status message
+    status_message[0] = '\0';
+
+    if (c == CTRL_KEY('q')) {
+        return 0;
+    } else if (c == CTRL_KEY('s')) {
+        save_file(buffer, filename);
+        snprintf(status_message, sizeof(status_message), "%s", " Saving...");
+    } else if (c == KEY_UP) {
+        if (y > 0) y--;
+        if (x > buffer_row(buffer, y)->len) {
+            x = buffer_row(buffer, y)->len;
+        }
+    } else if (c == KEY_DOWN) {
+        if (y < buffer->num_rows - 1) y++;
+        if (x > buffer_row(buffer, y)->len) {
+            x = buffer_row(buffer, y)->len;
+        }
+    } else if (c == KEY_LEFT) {
+        if (x > 0) {
+            x--;
+        } else if (y > 0) {
+            y--;
+            x = buffer_row(buffer, y)->len;
+        }
+    } else if (c == KEY_RIGHT) {
+        if (x < buffer_row(buffer, y)->len) {
+            x++;
+        } else if (y < buffer->num_rows - 1) {
+            y++;
+            x = 0;
+        }
+    } else if (c == KEY_BACKSPACE || c == 127) {
+        if (x > 0) {
+            delete_char(buffer, x, y);
+            highlighter_delta(y, x - 1, y, x, "", 0);
+            x--;
+        } else if (y > 0) {
+            int prev_len = join_rows(buffer, y);
+            highlighter_delta(y - 1, prev_len, y, 0, "", 0);
+            y--;
+            x = prev_len;
+        }
+        highlight_dirty(buffer);
+    } else if (c == '\n') {
+        split_row(buffer, x, y);
+        highlighter_delta(y, x, y, x, "\n", 1);
+        y++;
+        x = 0;
+        highlight_dirty(buffer);
+    } else if (isprint(c)) {
+        insert_char(buffer, x, y, c);
+        char ch = (char)c;
+        highlighter_delta(y, x, y, x, &ch, 1);
+        x++;
+        highlight_dirty(buffer);
+    }
+
+    *cursor_x = x;
+    *cursor_y = y;
+    return 1;
+}
+
+int is_text_key(int c) {
+    return c == '\n' || (c >= 0 && c < 256 && isprint(c));
+}
+
+// Text keys already waiting behind a text key, which is how a paste arrives, gathered to go in as one edit
+char *paste;
+size_t paste_len;
+size_t paste_cap;
+
+// Take key c along with every text key already waiting behind it and insert them as one edit, with one
+// highlight and one repaint for the lot. Returns false, leaving c to editor_key(), if nothing was waiting.
+int editor_paste(TextBuffer *buffer, int c, int *cursor_x, int *cursor_y) {
+    if (!is_text_key(c)) return 0;
+    timeout(0);
+    paste_len = 0;
+    int next;
+    while (is_text_key(next = getch())) {
+        if (paste_len + 2 > paste_cap) {
+            paste_cap = paste_cap * 2 + 4096;
+            paste = realloc(paste, paste_cap);
+        }
+        if (!paste_len) paste[paste_len++] = (char)c;
+        paste[paste_len++] = (char)next;
+    }
+    timeout(-1);
+    // The key that ended it is handled as usual next time round
+    if (next != ERR) ungetch(next);
+    if (!paste_len) return 0;
+
+    status_message[0] = '\0';
+    int x = *cursor_x;
+    int y = *cursor_y;
+    insert_text(buffer, cursor_x, cursor_y, paste, paste_len);
+    highlighter_delta(y, x, y, x, paste, (int)paste_len);
+    highlight_dirty(buffer);
+    return 1;
+}
+
+// Do what key c does, then every key already waiting behind it, so keys that come faster than the screen
+// can be drawn are all done before it is. While they keep coming it waits for more until the next frame is
+// due, but never holds up the screen for more than a frame. Returns false if one of them quits.
+int editor_keys(TextBuffer *buffer, const char *filename, int c, int *cursor_x, int *cursor_y) {
+    long long start = now_ms();
+    while (1) {
+        if (!editor_paste(buffer, c, cursor_x, cursor_y) && !editor_key(buffer, filename, c, cursor_x, cursor_y)) {
+            return 0;
+        }
+        long long now = now_ms();
+        if (now - start >= frame_budget) return 1;
+        long long wait = frame.drawn_at + frame_budget - now;
+        timeout(wait > 0 ? (int)wait : 0);
+        c = getch();
+        timeout(-1);
+        if (c == ERR) return 1;
+    }
+}
+
+#ifndef TE_BENCH
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s filename\n", argv[0]);
+    int opt;
+    const char *highlighter_command = NULL;
+    const char *cache_dir = NULL;
+    const Language *language = NULL;
+    int threads = 0;
+    while ((opt = getopt(argc, argv, "c:C:f:j:l:p:t")) != -1) {
+        if (opt == 'c') {
+            highlighter_command = optarg;
+        } else if (opt == 'C') {
+            cache_dir = optarg;
+        } else if (opt == 'f') {
+            frame_budget = atoi(optarg);
+        } else if (opt == 'j') {
+            threads = atoi(optarg);
+        } else if (opt == 'l') {
+            language = language_named(optarg);
+            if (!language) {
+                fprintf(stderr, "Unknown language %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+        } else if (opt == 'p') {
+            highlight_prefetch = atoi(optarg);
+        } else if (opt == 't') {
+            stats.enabled = 1;
+        } else {
+            optind = argc; // Force the usage message
+            break;
+        }
+    }
+    if (optind >= argc) {
+        printf("Usage: %s [-c highlighter_command] [-C cache_dir] [-f frame_ms] [-j threads] [-l language] "
+               "[-p prefetch_rows] [-t] filename\n", argv[0]);
         exit(EXIT_FAILURE);
     }
+    const char *filename = argv[optind];
 
-    TextBuffer buffer = {0, NULL};
-    load_file(&buffer, argv[1]);
+    TextBuffer buffer = {.dirty_start = -1, .dirty_end = -1, .language = language, .threads = threads,
+                         .cache_dir = cache_dir};
+    load_file(&buffer, filename);
+
+    // A highlighter process that has gone away must not take the editor with it
+    signal(SIGPIPE, SIG_IGN);
+    if (highlighter_command) {
+        highlighter_start(highlighter_command, filename);
+        highlighter_init(&buffer);
+    }
+    highlight_worker_start(&buffer);
 
     initscr();
+    die_cleanup = restore_terminal;
     raw();
     noecho();
     keypad(stdscr, TRUE);
+    idlok(stdscr, TRUE); // Let ncurses use the terminal's line insert/delete when the body scrolls
     // Start colors
     start_color();
     // Initialize color pairs
@@ -260,104 +1116,27 @@ int main(int argc, char *argv[]) {
 
     int cursor_x = 0;
     int cursor_y = 0;
+    long long key_start = 0;
 
     while (1) {
         editor_refresh(&buffer, cursor_x, cursor_y);
-        int c = getch();
-
-        if (c == CTRL_KEY('q')) {
-            break;
-        } else if (c == CTRL_KEY('s')) {
-            save_file(&buffer, argv[1]);
-            mvprintw(LINES - 1, 0, "File saved. Press any key to continue.");
-            // Make the rest of the line the same colour
-            for (int i = 11; i < COLS; i++) {
-                addch(' ');
-            }
-            getch();
-        } else if (c == KEY_UP) {
-            if (cursor_y > 0) cursor_y--;
-            if (cursor_x > strlen(buffer.rows[cursor_y])) {
-                cursor_x = strlen(buffer.rows[cursor_y]);
-            }
-        } else if (c == KEY_DOWN) {
-            if (cursor_y < buffer.num_rows - 1) cursor_y++;
-            if (cursor_x > strlen(buffer.rows[cursor_y])) {
-                cursor_x = strlen(buffer.rows[cursor_y]);
-            }
-        } else if (c == KEY_LEFT) {
-            if (cursor_x > 0) {
-                cursor_x--;
-            } else if (cursor_y > 0) {
-                cursor_y--;
-                cursor_x = strlen(buffer.rows[cursor_y]);
-            }
-        } else if (c == KEY_RIGHT) {
-            if (cursor_x < strlen(buffer.rows[cursor_y])) {
-                cursor_x++;
-            } else if (cursor_y < buffer.num_rows - 1) {
-                cursor_y++;
-                cursor_x = 0;
-            }
-        } else if (c == KEY_BACKSPACE || c == 127) {
-            if (cursor_x > 0) {
-                delete_char(&buffer, cursor_x, cursor_y);
-                cursor_x--;
-            } else if (cursor_y > 0) {
-                int prev_len = strlen(buffer.rows[cursor_y - 1]);
-                buffer.rows[cursor_y - 1] = realloc(buffer.rows[cursor_y - 1], prev_len + strlen(buffer.rows[cursor_y]) + 1);
-                strcat(buffer.rows[cursor_y - 1], buffer.rows[cursor_y]);
-                free(buffer.rows[cursor_y]);
-                memmove(&buffer.rows[cursor_y], &buffer.rows[cursor_y + 1], sizeof(char*) * (buffer.num_rows - cursor_y - 1));
-
-                // Syntax highlighting
-                buffer.row_syntax[cursor_y - 1] = realloc(buffer.row_syntax[cursor_y - 1], prev_len + strlen(buffer.row_syntax[cursor_y]) + 1);
-                strcat(buffer.row_syntax[cursor_y - 1], buffer.row_syntax[cursor_y]);
-                free(buffer.row_syntax[cursor_y]);
-                memmove(&buffer.row_syntax[cursor_y], &buffer.row_syntax[cursor_y + 1], sizeof(char*) * (buffer.num_rows - cursor_y - 1));
-
-                buffer.num_rows--;
-                cursor_y--;
-                cursor_x = prev_len;
-            }
-            highlight_syntax(&buffer);
-        } else if (c == '\n') {
-            char *current_row = buffer.rows[cursor_y];
-            int len = strlen(current_row);
-
-            char *new_row = strdup(&current_row[cursor_x]);
-            current_row[cursor_x] = '\0';
-            current_row = realloc(current_row, cursor_x + 1);
-            buffer.rows[cursor_y] = current_row;
-
-            buffer.rows = realloc(buffer.rows, sizeof(char*) * (buffer.num_rows + 1));
-            memmove(&buffer.rows[cursor_y + 2], &buffer.rows[cursor_y + 1], sizeof(char*) * (buffer.num_rows - cursor_y - 1));
-            buffer.rows[cursor_y + 1] = new_row;
-
-            // Syntax highlighting
-            char *current_syntax = buffer.row_syntax[cursor_y];
-            char *new_syntax = strdup(&current_syntax[cursor_x]);
-            current_syntax[cursor_x] = '\0';
-            current_syntax = realloc(current_syntax, cursor_x + 1);
-            buffer.row_syntax[cursor_y] = current_syntax;
-
-            buffer.row_syntax = realloc(buffer.row_syntax, sizeof(char*) * (buffer.num_rows + 1));
-            memmove(&buffer.row_syntax[cursor_y + 2], &buffer.row_syntax[cursor_y + 1], sizeof(char*) * (buffer.num_rows - cursor_y - 1));
-            buffer.row_syntax[cursor_y + 1] = new_syntax;
-
-            buffer.num_rows++;
-            cursor_y++;
-            cursor_x = 0;
-            highlight_syntax(&buffer);
-        } else if (isprint(c)) {
-            insert_char(&buffer, cursor_x, cursor_y, c);
-            cursor_x++;
-            highlight_syntax(&buffer);
-        }
+        stat_record(STAT_KEY, key_start);
+        // Keep the highlighter process working on what is on screen
+        highlighter_request(&buffer, scroll_line - highlight_prefetch, scroll_line + LINES - 3 + highlight_prefetch);
+        int c = editor_getch(&buffer, cursor_x, cursor_y);
+        key_start = stat_start();
+        if (!editor_keys(&buffer, filename, c, &cursor_x, &cursor_y)) break;
     }
 
     endwin();
+    // A save still waiting on the disk has to be seen through, or the file is never renamed into place
+    if (save_report(&buffer) && buffer.saver.failed) fprintf(stderr, "%s\n", status_message + 1);
+    if (stats.enabled) stats_dump(stderr);
+    highlighter_stop();
     free_buffer(&buffer);
+    free(frame.chars);
+    free(paste);
+    scratch_free();
     return 0;
 }
-
+#endif
@@ -0,0 +1,519 @@
+//
+// Lexer generator for the toy editor's built-in highlighters.
+// Turns languages/*.lex token rule files into table-driven DFAs in generated C, run by highlight_dfa() in
+// sdslh.c. Usage: lexgen output.h rules.lex...
+//
+// A rule file has one rule per line, words separated by spaces, and # starting a comment line. A word can
+// be "quoted" and use \t \r \f \v \\ \" escapes. Colours are body, comment, keyword, string, number,
+// operator, variable or error.
+//
+//   language NAME .EXT...             Name of the language and the file extensions it is used for
+//   token COLOUR FIRST [REST]         A character from the class FIRST, then any from REST, e.g. a-zA-Z_
+//   line COLOUR OPEN                  OPEN up to the end of the row
+//   span COLOUR OPEN CLOSE [ESCAPE]   OPEN up to CLOSE, carrying on over as many rows as it takes
+//   quote COLOUR OPEN CLOSE [ESCAPE]  Like span, but ending at the end of the row if it is not closed
+//   other COLOUR                      Any other character, which is a token of its own
+//   keywords COLOUR WORD...           Words coloured COLOUR instead of as the token they would otherwise be
+//   ignorecase                        Keywords match in any mix of upper and lower case
+//
+// Keywords are found with a minimal perfect hash built here, so looking up an identifier costs one hash
+// over it and one comparison however many keywords the language has.
+// Every DFA state is accepting. A token is the longest run of characters the DFA moves through from its
+// start state, coloured by the state it stops in, so the lexer never has to back up.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#define MAX_STATES 254 // Row end states are kept in a byte, and 0xFF is the editor's LEX_UNKNOWN
+#define MAX_RULES 64
+#define MAX_WORDS 32
+#define MAX_KEYWORDS 4096
+#define MAX_WORD 256
+#define DFA_START 1 // State 0 ends a token
+#define OTHER_DEFAULT "operator"
+
+const char *COLOURS[] = {"body", "comment", "keyword", "string", "number", "operator", "variable", "error", NULL};
+const char *PAIRS[] = {"PAIR_BODY", "PAIR_COMMENT", "PAIR_KEYWORD", "PAIR_STRING", "PAIR_NUM", "PAIR_OPERATOR",
+                       "PAIR_VARIABLE", "PAIR_ERROR"};
+
+typedef struct {
+    char kind[16];
+    int colour;
+    char args[3][MAX_WORD];
+    int arg_len[3];
+    int num_args;
+    int line; // In the rule file, for errors
+} Rule;
+
+// The rule file being read
+const char *rule_file;
+char language_name[MAX_WORD];
+char extensions[MAX_WORD];
+Rule rules[MAX_RULES];
+int num_rules;
+int other_colour;
+char *keywords[MAX_KEYWORDS];
+int keyword_colours[MAX_KEYWORDS];
+int num_keywords;
+int ignore_case;
+unsigned long long rules_hash; // FNV-1a over the rule file, the generated language's version
+
+// The DFA being built
+unsigned char next[MAX_STATES][256];
+unsigned char colour[MAX_STATES];
+unsigned char carry[MAX_STATES]; // State a row ending here carries into the next row, 0 for none
+unsigned char literal_end[MAX_STATES]; // A complete OPEN literal ends here
+unsigned char keyword_state[MAX_STATES]; // Some keyword stops here, so tokens that do are looked up
+int num_states;
+
+// The keyword perfect hash - slot i holds keywords[order[i]]
+unsigned displace[MAX_KEYWORDS];
+int order[MAX_KEYWORDS];
+int num_buckets;
+
+void fail(int line, const char *message, const char *detail) {
+    fprintf(stderr, "%s:%d: %s%s%s\n", rule_file, line, message, detail ? " " : "", detail ? detail : "");
+    exit(EXIT_FAILURE);
+}
+
+// Split a rule line into words, handling quotes and escapes. Returns the number of words.
+int split_words(char *s, int line, char words[][MAX_WORD], int lens[]) {
+    int n = 0;
+    while (1) {
+        while (isspace((unsigned char)*s)) s++;
+        if (!*s) return n;
+        if (n == MAX_WORDS) fail(line, "too many words", NULL);
+        int quoted = *s == '"';
+        if (quoted) s++;
+        int len = 0;
+        while (*s && (quoted ? *s != '"' : !isspace((unsigned char)*s))) {
+            char c = *s++;
+            if (c == '\\' && *s) {
+                c = *s++;
+                if (c == 't') c = '\t';
+                else if (c == 'r') c = '\r';
+                else if (c == 'f') c = '\f';
+                else if (c == 'v') c = '\v';
+            }
+            if (len == MAX_WORD - 1) fail(line, "word too long", NULL);
+            words[n][len++] = c;
+        }
+        if (quoted) {
+            if (*s != '"') fail(line, "unterminated quote", NULL);
+            s++;
+        }
+        words[n][len] = '\0';
+        lens[n++] = len;
+    }
+}
+
+int colour_named(const char *name, int line) {
+    for (int i = 0; COLOURS[i]; i++) {
+        if (strcmp(COLOURS[i], name) == 0) return i;
+    }
+    fail(line, "unknown colour", name);
+    return 0;
+}
+
+void read_rules(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    rule_file = filename;
+    language_name[0] = '\0';
+    extensions[0] = '\0';
+    num_rules = 0;
+    other_colour = colour_named(OTHER_DEFAULT, 0);
+    for (int i = 0; i < num_keywords; i++) free(keywords[i]);
+    num_keywords = 0;
+    ignore_case = 0;
+    rules_hash = 0xCBF29CE484222325ull;
+
+    char text[1024];
+    char words[MAX_WORDS][MAX_WORD];
+    int lens[MAX_WORDS];
+    for (int line = 1; fgets(text, sizeof(text), f); line++) {
+        for (const char *c = text; *c; c++) rules_hash = (rules_hash ^ (unsigned char)*c) * 0x100000001B3ull;
+        char *s = text;
+        while (isspace((unsigned char)*s)) s++;
+        if (*s == '#') continue;
+        int n = split_words(s, line, words, lens);
+        if (!n) continue;
+
+        if (strcmp(words[0], "language") == 0) {
+            if (n < 2) fail(line, "language needs a name", NULL);
+            strcpy(language_name, words[1]);
+            for (int i = 2; i < n; i++) {
+                if (strlen(extensions) + lens[i] + 2 > sizeof(extensions)) fail(line, "too many extensions", NULL);
+                if (i > 2) strcat(extensions, " ");
+                strcat(extensions, words[i]);
+            }
+        } else if (strcmp(words[0], "keywords") == 0) {
+            if (n < 3) fail(line, "keywords needs a colour and words", NULL);
+            int keyword_colour = colour_named(words[1], line);
+            for (int i = 2; i < n; i++) {
+                if (num_keywords == MAX_KEYWORDS) fail(line, "too many keywords", NULL);
+                keyword_colours[num_keywords] = keyword_colour;
+                keywords[num_keywords++] = strdup(words[i]);
+            }
+        } else if (strcmp(words[0], "ignorecase") == 0) {
+            ignore_case = 1;
+        } else if (strcmp(words[0], "other") == 0) {
+            if (n != 2) fail(line, "other needs a colour", NULL);
+            other_colour = colour_named(words[1], line);
+        } else {
+            int min = 0, max = 0;
+            if (strcmp(words[0], "token") == 0) min = 1, max = 2;
+            else if (strcmp(words[0], "line") == 0) min = 1, max = 1;
+            else if (strcmp(words[0], "span") == 0 || strcmp(words[0], "quote") == 0) min = 2, max = 3;
+            else fail(line, "unknown rule", words[0]);
+            if (n - 2 < min || n - 2 > max) fail(line, "wrong number of words for", words[0]);
+            if (num_rules == MAX_RULES) fail(line, "too many rules", NULL);
+
+            Rule *rule = &rules[num_rules++];
+            strcpy(rule->kind, words[0]);
+            rule->colour = colour_named(words[1], line);
+            rule->num_args = n - 2;
+            rule->line = line;
+            for (int i = 2; i < n; i++) {
+                if (!lens[i]) fail(line, "empty word in", words[0]);
+                memcpy(rule->args[i - 2], words[i], lens[i] + 1);
+                rule->arg_len[i - 2] = lens[i];
+            }
+        }
+    }
+    fclose(f);
+    if (!language_name[0]) fail(0, "no language line", NULL);
+}
+
+// Expand a class like a-zA-Z_ into a byte set - a - at either end stands for itself
+void expand_class(const char *s, int len, unsigned char *set) {
+    memset(set, 0, 256);
+    for (int i = 0; i < len; i++) {
+        if (i + 2 < len && s[i + 1] == '-') {
+            for (int c = (unsigned char)s[i]; c <= (unsigned char)s[i + 2]; c++) set[c] = 1;
+            i += 2;
+        } else {
+            set[(unsigned char)s[i]] = 1;
+        }
+    }
+}
+
+int new_state(int state_colour, int line) {
+    if (num_states == MAX_STATES) fail(line, "too many DFA states", NULL);
+    memset(next[num_states], 0, 256);
+    colour[num_states] = (unsigned char)state_colour;
+    carry[num_states] = 0;
+    literal_end[num_states] = 0;
+    keyword_state[num_states] = 0;
+    return num_states++;
+}
+
+// Walk an OPEN literal down from the start state, adding states as needed. Returns its last state.
+int add_literal(const Rule *rule) {
+    const char *s = rule->args[0];
+    int len = rule->arg_len[0];
+    int state = DFA_START;
+    for (int i = 0; i < len; i++) {
+        int c = (unsigned char)s[i];
+        int to = next[state][c];
+        // One literal cannot be the start of another
+        if (to && (literal_end[to] || i == len - 1)) fail(rule->line, "literal overlaps another", s);
+        if (!to) {
+            // Part of the way through a literal is just the other colour, until the literal is complete
+            to = new_state(i == len - 1 ? rule->colour : other_colour, rule->line);
+            next[state][c] = (unsigned char)to;
+        }
+        state = to;
+    }
+    literal_end[state] = 1;
+    return state;
+}
+
+// Length of the longest start of close that ends the first j characters of close followed by c
+int close_match(const char *close, int k, int j, int c) {
+    for (int m = j + 1 < k ? j + 1 : k; m > 0; m--) {
+        if ((unsigned char)close[m - 1] != c) continue;
+        if (memcmp(close, close + j - (m - 1), m - 1) == 0) return m;
+    }
+    return 0;
+}
+
+void build_dfa(void) {
+    num_states = 0;
+    new_state(0, 0); // The dead state that ends a token
+    new_state(other_colour, 0);
+    unsigned char token_start[256] = {0};
+
+    // Tokens made of character classes
+    for (int r = 0; r < num_rules; r++) {
+        Rule *rule = &rules[r];
+        if (strcmp(rule->kind, "token") != 0) continue;
+        unsigned char first[256], rest[256];
+        expand_class(rule->args[0], rule->arg_len[0], first);
+        if (rule->num_args > 1) expand_class(rule->args[1], rule->arg_len[1], rest);
+        else memset(rest, 0, 256);
+        int state = new_state(rule->colour, rule->line);
+        for (int c = 0; c < 256; c++) {
+            if (first[c]) {
+                if (next[DFA_START][c]) fail(rule->line, "token starts like another", rule->args[0]);
+                next[DFA_START][c] = (unsigned char)state;
+                token_start[c] = 1;
+            }
+            if (rest[c]) next[state][c] = (unsigned char)state;
+        }
+    }
+
+    // Literals, then what follows them
+    for (int r = 0; r < num_rules; r++) {
+        Rule *rule = &rules[r];
+        if (strcmp(rule->kind, "token") == 0) continue;
+        if (token_start[(unsigned char)rule->args[0][0]]) fail(rule->line, "literal starts like a token", rule->args[0]);
+        int open = add_literal(rule);
+
+        if (strcmp(rule->kind, "line") == 0) {
+            memset(next[open], open, 256);
+            continue;
+        }
+
+        // Inside, in[j] has matched the first j characters of CLOSE - in[0] is where OPEN ended
+        const char *close = rule->args[1];
+        int k = rule->arg_len[1];
+        int escape = rule->num_args > 2 ? (unsigned char)rule->args[2][0] : -1;
+        int multi_row = strcmp(rule->kind, "span") == 0;
+        int in[MAX_WORD];
+        in[0] = open;
+        for (int j = 1; j < k; j++) in[j] = new_state(rule->colour, rule->line);
+        int done = new_state(rule->colour, rule->line);
+        int escaped = escape >= 0 ? new_state(rule->colour, rule->line) : 0;
+        for (int j = 0; j < k; j++) {
+            for (int c = 0; c < 256; c++) {
+                int m = close_match(close, k, j, c);
+                next[in[j]][c] = (unsigned char)(c == escape ? escaped : m == k ? done : in[m]);
+            }
+            // A partial CLOSE does not carry over the end of a row
+            carry[in[j]] = (unsigned char)(multi_row ? open : 0);
+        }
+        if (escaped) {
+            memset(next[escaped], open, 256);
+            carry[escaped] = (unsigned char)(multi_row ? open : 0);
+        }
+    }
+
+    // Anything else is a token of one character
+    int other = new_state(other_colour, 0);
+    for (int c = 0; c < 256; c++) {
+        if (!next[DFA_START][c]) next[DFA_START][c] = (unsigned char)other;
+    }
+}
+
+// FNV-1a over a word, in lower case if fold is set - must match keyword_hash() in sdslh.c
+unsigned long long keyword_hash(const char *s, int len, int fold) {
+    unsigned long long h = 0xCBF29CE484222325ull;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (fold && c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 0x100000001B3ull;
+    }
+    return h;
+}
+
+// Slot of a word with hash h in a bucket displaced by d - must match keyword_slot() in sdslh.c
+unsigned keyword_slot(unsigned long long h, unsigned d, unsigned n) {
+    h += d * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 31)) * 0xBF58476D1CE4E5B9ull;
+    return (unsigned)((h ^ (h >> 29)) % n);
+}
+
+// Where the DFA stops after word, or 0 if the word is not a single token
+int token_state(const char *word, int upper) {
+    int state = DFA_START;
+    for (const char *p = word; *p && state; p++) state = next[state][upper ? toupper((unsigned char)*p) : (unsigned char)*p];
+    return state;
+}
+
+// Check every keyword is a single token, and mark the states keyword tokens stop in
+void mark_keyword_states(void) {
+    for (int k = 0; k < num_keywords; k++) {
+        int state = token_state(keywords[k], 0);
+        if (!state) fail(0, "keyword is not a single token:", keywords[k]);
+        keyword_state[state] = 1;
+        // In upper case it may be a different kind of token
+        if (ignore_case && (state = token_state(keywords[k], 1))) keyword_state[state] = 1;
+    }
+}
+
+// Hash and displace - keywords are hashed into buckets, then the fullest buckets first are each given
+// the first displacement that moves all their keywords into free slots
+void build_keyword_hash(void) {
+    int n = num_keywords;
+    num_buckets = n / 2 + 1;
+    static int bucket_of[MAX_KEYWORDS], bucket_size[MAX_KEYWORDS], by_size[MAX_KEYWORDS];
+    static unsigned long long hashes[MAX_KEYWORDS];
+    memset(bucket_size, 0, sizeof(bucket_size));
+    for (int k = 0; k < n; k++) {
+        for (int j = 0; j < k; j++) {
+            int same = ignore_case ? strcasecmp(keywords[j], keywords[k]) == 0 : strcmp(keywords[j], keywords[k]) == 0;
+            if (same) fail(0, "duplicate keyword", keywords[k]);
+        }
+        hashes[k] = keyword_hash(keywords[k], (int)strlen(keywords[k]), ignore_case);
+        bucket_of[k] = (int)(hashes[k] % (unsigned)num_buckets);
+        bucket_size[bucket_of[k]]++;
+    }
+    for (int b = 0; b < num_buckets; b++) by_size[b] = b;
+    for (int i = 1; i < num_buckets; i++) {
+        for (int j = i; j > 0 && bucket_size[by_size[j]] > bucket_size[by_size[j - 1]]; j--) {
+            int t = by_size[j];
+            by_size[j] = by_size[j - 1];
+            by_size[j - 1] = t;
+        }
+    }
+
+    for (int i = 0; i < n; i++) order[i] = -1;
+    memset(displace, 0, sizeof(displace));
+    for (int i = 0; i < num_buckets && bucket_size[by_size[i]]; i++) {
+        int b = by_size[i];
+        for (unsigned d = 0;; d++) {
+            if (d == 1u << 24) fail(0, "cannot build the keyword hash", NULL);
+            int slots[MAX_KEYWORDS];
+            int count = 0, ok = 1;
+            for (int k = 0; k < n && ok; k++) {
+                if (bucket_of[k] != b) continue;
+                int slot = (int)keyword_slot(hashes[k], d, (unsigned)n);
+                if (order[slot] >= 0) ok = 0;
+                for (int j = 0; j < count && ok; j++) ok = slots[j] != slot;
+                slots[count++] = slot;
+            }
+            if (!ok) continue;
+            count = 0;
+            for (int k = 0; k < n; k++) {
+                if (bucket_of[k] == b) order[slots[count++]] = k;
+            }
+            displace[b] = d;
+            break;
+        }
+    }
+}
+
+// Write a string as a C literal
+void emit_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(out, "\\%c", *s);
+        else if (isprint((unsigned char)*s)) fputc(*s, out);
+        else fprintf(out, "\\x%02x\"\"", (unsigned char)*s);
+    }
+    fputc('"', out);
+}
+
+// Write the DFA out, with bytes that every state treats alike sharing a column of the transition table
+void emit_dfa(FILE *out, const char *id) {
+    unsigned char classes[256];
+    int columns[256]; // A byte standing for each column
+    int num_columns = 0;
+    for (int c = 0; c < 256; c++) {
+        int col = 0;
+        for (; col < num_columns; col++) {
+            int s = 0;
+            while (s < num_states && next[s][c] == next[s][columns[col]]) s++;
+            if (s == num_states) break;
+        }
+        if (col == num_columns) columns[num_columns++] = c;
+        classes[c] = (unsigned char)col;
+    }
+
+    const char *base = strrchr(rule_file, '/');
+    fprintf(out, "// %s - generated from %s\n", language_name, base ? base + 1 : rule_file);
+    fprintf(out, "static const unsigned char %s_classes[256] = {", id);
+    for (int c = 0; c < 256; c++) fprintf(out, "%s%d,", c % 32 ? " " : "\n    ", classes[c]);
+    fprintf(out, "\n};\n");
+    fprintf(out, "static const unsigned char %s_next[%d][%d] = {\n", id, num_states, num_columns);
+    for (int s = 0; s < num_states; s++) {
+        fprintf(out, "    {");
+        for (int col = 0; col < num_columns; col++) fprintf(out, "%s%d", col ? ", " : "", next[s][columns[col]]);
+        fprintf(out, "},\n");
+    }
+    fprintf(out, "};\n");
+    fprintf(out, "static const unsigned char %s_pairs[%d] = {0", id, num_states);
+    for (int s = 1; s < num_states; s++) fprintf(out, ", %s", PAIRS[colour[s]]);
+    fprintf(out, "};\n");
+    fprintf(out, "static const unsigned char %s_carry[%d] = {", id, num_states);
+    for (int s = 0; s < num_states; s++) fprintf(out, "%s%d", s ? ", " : "", carry[s]);
+    fprintf(out, "};\n");
+    if (num_keywords) {
+        fprintf(out, "static const unsigned char %s_keyword_states[%d] = {", id, num_states);
+        for (int s = 0; s < num_states; s++) fprintf(out, "%s%d", s ? ", " : "", keyword_state[s]);
+        fprintf(out, "};\n");
+        fprintf(out, "static const unsigned %s_displace[%d] = {", id, num_buckets);
+        for (int b = 0; b < num_buckets; b++) fprintf(out, "%s%s%u", b ? "," : "", b % 16 ? " " : "\n    ", displace[b]);
+        fprintf(out, "\n};\n");
+        fprintf(out, "static const char *const %s_keywords[%d] = {", id, num_keywords);
+        for (int i = 0; i < num_keywords; i++) {
+            fprintf(out, "%s", i % 8 ? ", " : i ? ",\n    " : "\n    ");
+            emit_string(out, keywords[order[i]]);
+        }
+        fprintf(out, "\n};\n");
+        fprintf(out, "static const unsigned char %s_keyword_pairs[%d] = {", id, num_keywords);
+        for (int i = 0; i < num_keywords; i++) {
+            fprintf(out, "%s%s", i % 8 ? ", " : i ? ",\n    " : "\n    ", PAIRS[keyword_colours[order[i]]]);
+        }
+        fprintf(out, "\n};\n");
+    }
+    fprintf(out, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s output.h rules.lex...\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    FILE *out = fopen(argv[1], "w");
+    if (!out) {
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out, "// Generated by lexgen - do not edit\n\n");
+
+    // The registry entries are collected as the languages are written
+    char registry[64 * 1024] = "";
+    for (int i = 2; i < argc; i++) {
+        read_rules(argv[i]);
+        build_dfa();
+        mark_keyword_states();
+        if (num_keywords) build_keyword_hash();
+        char id[MAX_WORD + 8];
+        int n = snprintf(id, sizeof(id), "lex_");
+        for (const char *p = language_name; *p; p++) id[n++] = isalnum((unsigned char)*p) ? *p : '_';
+        id[n] = '\0';
+        emit_dfa(out, id);
+        size_t used = strlen(registry);
+        used += snprintf(registry + used, sizeof(registry) - used,
+                         "    {\"%s\", \"%s\", highlight_dfa, {.classes = %s_classes, .next = &%s_next[0][0], \\\n"
+                         "        .columns = sizeof(%s_next[0]), .pairs = %s_pairs, .carry = %s_carry",
+                         language_name, extensions, id, id, id, id, id);
+        if (num_keywords) {
+            int keyword_max = 0;
+            for (int k = 0; k < num_keywords; k++) {
+                if ((int)strlen(keywords[k]) > keyword_max) keyword_max = (int)strlen(keywords[k]);
+            }
+            used += snprintf(registry + used, sizeof(registry) - used,
+                             ", \\\n        .keyword_states = %s_keyword_states, .displace = %s_displace, .buckets = %d, "
+                             ".keywords = %s_keywords, \\\n        .keyword_pairs = %s_keyword_pairs, .num_keywords = %d, "
+                             ".keyword_max = %d, .fold = %d",
+                             id, id, num_buckets, id, id, num_keywords, keyword_max, ignore_case);
+        }
+        snprintf(registry + used, sizeof(registry) - used, "}, 0x%016llxull, %d}, \\\n", rules_hash, num_states);
+    }
+    fprintf(out, "#define GENERATED_LANGUAGES \\\n%s\n", registry);
+
+    if (fclose(out) != 0) {
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
@@ -0,0 +1,197 @@
+//
+// The part of ncurses the toy editor uses, drawing into memory instead of a terminal - for te_bench, so
+// the editor can be run and timed without one. Cells are really written, so rendering costs about what it
+// does against ncurses' own screen copy, less the terminal output.
+//
+#ifndef NULL_SCREEN_H
+#define NULL_SCREEN_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OK 0
+#define ERR (-1)
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define KEY_DOWN 0402
+#define KEY_UP 0403
+#define KEY_LEFT 0404
+#define KEY_RIGHT 0405
+#define KEY_BACKSPACE 0407
+
+#define COLOR_BLACK 0
+#define COLOR_RED 1
+#define COLOR_GREEN 2
+#define COLOR_YELLOW 3
+#define COLOR_BLUE 4
+#define COLOR_MAGENTA 5
+#define COLOR_CYAN 6
+#define COLOR_WHITE 7
+#define COLOR_PAIR(n) ((n) << 8)
+
+typedef struct {
+    int max_y;
+    int max_x;
+    int cur_y;
+    int cur_x;
+    int attr;
+    int top; // Scrolling region
+    int bottom;
+    char *chars;
+    short *attrs;
+    // Keys for getch() to hand out, pushed by null_screen_key()
+    int *keys;
+    int num_keys;
+    int next_key;
+    int key_cap;
+} NullScreen;
+
+static NullScreen null_screen = {.max_y = 24, .max_x = 80};
+static NullScreen *const stdscr = &null_screen;
+#define LINES (null_screen.max_y)
+#define COLS (null_screen.max_x)
+
+#define getmaxyx(win, y, x) ((y) = (win)->max_y, (x) = (win)->max_x)
+#define getcury(win) ((win)->cur_y)
+#define getcurx(win) ((win)->cur_x)
+
+// Set the screen size - before initscr()
+static inline void null_screen_size(int rows, int cols) {
+    null_screen.max_y = rows;
+    null_screen.max_x = cols;
+}
+
+static inline void null_screen_key(int c) {
+    if (null_screen.num_keys == null_screen.key_cap) {
+        null_screen.key_cap = null_screen.key_cap * 2 + 64;
+        null_screen.keys = realloc(null_screen.keys, sizeof(int) * null_screen.key_cap);
+    }
+    null_screen.keys[null_screen.num_keys++] = c;
+}
+
+static inline void *initscr(void) {
+    size_t cells = (size_t)null_screen.max_y * null_screen.max_x;
+    null_screen.chars = realloc(null_screen.chars, cells);
+    null_screen.attrs = realloc(null_screen.attrs, sizeof(short) * cells);
+    memset(null_screen.chars, ' ', cells);
+    memset(null_screen.attrs, 0, sizeof(short) * cells);
+    null_screen.top = 0;
+    null_screen.bottom = null_screen.max_y - 1;
+    return stdscr;
+}
+
+static inline int endwin(void) {
+    return OK;
+}
+
+static inline int clear(void) {
+    size_t cells = (size_t)null_screen.max_y * null_screen.max_x;
+    memset(null_screen.chars, ' ', cells);
+    memset(null_screen.attrs, 0, sizeof(short) * cells);
+    return OK;
+}
+
+static inline int move(int y, int x) {
+    if (y < 0 || y >= null_screen.max_y || x < 0 || x >= null_screen.max_x) return ERR;
+    null_screen.cur_y = y;
+    null_screen.cur_x = x;
+    return OK;
+}
+
+static inline int attron(int attr) {
+    null_screen.attr = attr;
+    return OK;
+}
+
+// Write n characters at the cursor, wrapping at the right edge and stopping at the bottom right
+static inline int addnstr(const char *s, int n) {
+    while (n > 0) {
+        int room = null_screen.max_x - null_screen.cur_x;
+        int count = n < room ? n : room;
+        size_t at = (size_t)null_screen.cur_y * null_screen.max_x + null_screen.cur_x;
+        memcpy(null_screen.chars + at, s, count);
+        for (int i = 0; i < count; i++) null_screen.attrs[at + i] = (short)null_screen.attr;
+        s += count;
+        n -= count;
+        null_screen.cur_x += count;
+        if (null_screen.cur_x < null_screen.max_x) break;
+        if (null_screen.cur_y == null_screen.max_y - 1) {
+            null_screen.cur_x = null_screen.max_x - 1;
+            return ERR;
+        }
+        null_screen.cur_x = 0;
+        null_screen.cur_y++;
+    }
+    return OK;
+}
+
+static inline int addch(int c) {
+    char ch = (char)c;
+    return addnstr(&ch, 1);
+}
+
+static inline int mvprintw(int y, int x, const char *format, ...) {
+    char text[1024];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (n >= (int)sizeof(text)) n = sizeof(text) - 1;
+    if (move(y, x) == ERR) return ERR;
+    return addnstr(text, n);
+}
+
+static inline int setscrreg(int top, int bottom) {
+    null_screen.top = top;
+    null_screen.bottom = bottom;
+    return OK;
+}
+
+// Scroll the scrolling region by n lines, up for positive n, blanking the lines that come in
+static inline int scrl(int n) {
+    int width = null_screen.max_x;
+    int height = null_screen.bottom - null_screen.top + 1;
+    int shift = n > 0 ? n : -n;
+    if (shift > height) shift = height;
+    int kept = height - shift;
+    char *chars = null_screen.chars + (size_t)null_screen.top * width;
+    short *attrs = null_screen.attrs + (size_t)null_screen.top * width;
+    int from = n > 0 ? shift : 0;
+    int to = n > 0 ? 0 : shift;
+    int blank = n > 0 ? kept : 0;
+    memmove(chars + (size_t)to * width, chars + (size_t)from * width, (size_t)kept * width);
+    memmove(attrs + (size_t)to * width, attrs + (size_t)from * width, sizeof(short) * kept * width);
+    memset(chars + (size_t)blank * width, ' ', (size_t)shift * width);
+    memset(attrs + (size_t)blank * width, 0, sizeof(short) * shift * width);
+    return OK;
+}
+
+// The next pushed key, or ERR once they have all been handed out
+static inline int getch(void) {
+    return null_screen.next_key < null_screen.num_keys ? null_screen.keys[null_screen.next_key++] : ERR;
+}
+
+// Hand a key back to be the next getch() - only ever the one it just handed out
+static inline int ungetch(int c) {
+    if (!null_screen.next_key) return ERR;
+    null_screen.keys[--null_screen.next_key] = c;
+    return OK;
+}
+
+// Nothing to configure without a terminal
+static inline int refresh(void) { return OK; }
+static inline void timeout(int delay) { (void)delay; }
+static inline int raw(void) { return OK; }
+static inline int noecho(void) { return OK; }
+static inline int start_color(void) { return OK; }
+static inline int keypad(void *win, int on) { (void)win; (void)on; return OK; }
+static inline int idlok(void *win, int on) { (void)win; (void)on; return OK; }
+static inline int scrollok(void *win, int on) { (void)win; (void)on; return OK; }
+static inline int init_pair(short pair, short fg, short bg) { (void)pair; (void)fg; (void)bg; return OK; }
+
+#endif // NULL_SCREEN_H
@@ -0,0 +1,1903 @@
+//
+// libsdslh - see sdslh.h
+//
+#include "sdslh.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+void (*die_cleanup)(void);
+
+void die(const char *s) {
+    if (die_cleanup) die_cleanup();
+    perror(s);
+    exit(EXIT_FAILURE);
+}
+
+const char *const STAT_NAMES[STAT_COUNT] = {"key", "edit", "highlight", "job", "render", "highlighter"};
+
+Stats stats;
+
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The time to pass to stat_record() later, or 0 when timing is off so it costs nothing
+long long stat_start(void) {
+    return stats.enabled ? now_ns() : 0;
+}
+
+// Values below 2^STAT_SUB_BITS get a bucket each, then every power of two is split into 2^STAT_SUB_BITS
+int stat_bucket(long long ns) {
+    if (ns < (1 << STAT_SUB_BITS)) return (int)ns;
+    int exponent = 63 - __builtin_clzll((unsigned long long)ns);
+    int sub = (int)(ns >> (exponent - STAT_SUB_BITS)) & ((1 << STAT_SUB_BITS) - 1);
+    return ((exponent - STAT_SUB_BITS + 1) << STAT_SUB_BITS) + sub;
+}
+
+// The highest value that lands in a bucket
+long long stat_bucket_top(int bucket) {
+    if (bucket < (1 << STAT_SUB_BITS)) return bucket;
+    int exponent = (bucket >> STAT_SUB_BITS) + STAT_SUB_BITS - 1;
+    long long sub = bucket & ((1 << STAT_SUB_BITS) - 1);
+    return (((1LL << STAT_SUB_BITS) + sub + 1) << (exponent - STAT_SUB_BITS)) - 1;
+}
+
+void histogram_record(Histogram *histogram, long long ns) {
+    if (ns < 0) ns = 0;
+    histogram->buckets[stat_bucket(ns)]++;
+    histogram->count++;
+    if (ns > histogram->max) histogram->max = ns;
+}
+
+void stat_record(int stat, long long start) {
+    if (start) histogram_record(&stats.histograms[stat], now_ns() - start);
+}
+
+// The value (ns) that percent of the times are no greater than
+long long stat_percentile(const Histogram *histogram, double percent) {
+    long long wanted = (long long)(histogram->count * percent / 100 + 0.5);
+    if (wanted < 1) wanted = 1;
+    long long seen = 0;
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= wanted) return stat_bucket_top(i) < histogram->max ? stat_bucket_top(i) : histogram->max;
+    }
+    return histogram->max;
+}
+
+void stats_dump(FILE *fp) {
+    fprintf(fp, "%-12s %10s %10s %10s %10s %10s %10s\n", "phase (ms)", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        const Histogram *histogram = &stats.histograms[i];
+        if (!histogram->count) continue;
+        fprintf(fp, "%-12s %10lld %10.3f %10.3f %10.3f %10.3f %10.3f\n", STAT_NAMES[i], histogram->count,
+                stat_percentile(histogram, 50) / 1e6, stat_percentile(histogram, 90) / 1e6,
+                stat_percentile(histogram, 99) / 1e6, stat_percentile(histogram, 99.9) / 1e6, histogram->max / 1e6);
+    }
+}
+
+// Bump-allocate size bytes, starting a new slab when the current one is full
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7; // Keep blocks pointer aligned for the free lists
+    Slab *slab = arena->slabs;
+    if (!slab || slab->size - slab->used < size) {
+        size_t slab_size = size > SLAB_SIZE ? size : SLAB_SIZE;
+        Slab *new_slab = malloc(sizeof(Slab) + slab_size);
+        new_slab->used = 0;
+        new_slab->size = slab_size;
+        if (slab && size > SLAB_SIZE / 4) {
+            // A huge block gets a slab of its own - keep filling the current one
+            new_slab->next = slab->next;
+            slab->next = new_slab;
+        } else {
+            new_slab->next = slab;
+            arena->slabs = new_slab;
+        }
+        slab = new_slab;
+    }
+    void *block = slab->data + slab->used;
+    slab->used += size;
+    return block;
+}
+
+void arena_free(Arena *arena) {
+    Slab *slab = arena->slabs;
+    while (slab) {
+        Slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    memset(arena, 0, sizeof(Arena));
+}
+
+// Pool class for a block of size bytes, or -1 if it is too big for the pool
+int pool_class(size_t size) {
+    int class = 0;
+    while ((size_t)POOL_MIN << class < size) {
+        if (++class == POOL_CLASSES) return -1;
+    }
+    return class;
+}
+
+void *pool_alloc(Arena *arena, int class) {
+    void *block = arena->free_list[class];
+    if (block) {
+        arena->free_list[class] = *(void **)block;
+        return block;
+    }
+    return arena_alloc(arena, (size_t)POOL_MIN << class);
+}
+
+void pool_release(Arena *arena, void *block, int class) {
+    *(void **)block = arena->free_list[class];
+    arena->free_list[class] = block;
+}
+
+// Runs are unpacked here to be worked on, and packed back into the row when done - one set per thread, as
+// the parallel highlighting threads build runs too
+_Thread_local Run *run_scratch;
+_Thread_local int run_scratch_cap;
+_Thread_local unsigned char *pack_scratch;
+_Thread_local int pack_scratch_cap;
+
+void runs_free(Arena *arena, Row *row) {
+    if (row->run_store == ROW_POOL) pool_release(arena, row->runs, pool_class(row->run_cap));
+    else if (row->run_store == ROW_HEAP) free(row->runs);
+}
+
+// Add a run at index n of the scratch, after the run before it - it is merged into that run if they touch
+// and are the same colour. Returns the number of runs now in the scratch.
+int run_push(int n, int start, int len, int pair) {
+    if (len <= 0 || pair == PAIR_BODY || pair == 0) return n;
+    if (n && run_scratch[n - 1].pair == pair && run_scratch[n - 1].start + run_scratch[n - 1].len == start) {
+        run_scratch[n - 1].len += len;
+        return n;
+    }
+    if (n == run_scratch_cap) {
+        run_scratch_cap = run_scratch_cap * 2 + 64;
+        run_scratch = realloc(run_scratch, sizeof(Run) * run_scratch_cap);
+    }
+    run_scratch[n] = (Run){start, len, pair};
+    return n + 1;
+}
+
+// Add runs at index n of the scratch for len characters from column x, coloured one byte per character
+// by syntax. Returns the number of runs now in the scratch.
+int runs_from_syntax(int n, int x, const char *syntax, int len) {
+    for (int j = 0; j < len;) {
+        int end = j + 1;
+        while (end < len && syntax[end] == syntax[j]) end++;
+        n = run_push(n, x + j, end - j, syntax[j]);
+        j = end;
+    }
+    return n;
+}
+
+const unsigned char *unpack_varint(const unsigned char *p, int *value) {
+    unsigned v = 0;
+    for (int shift = 0;; shift += 7) {
+        v |= (unsigned)(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)) break;
+    }
+    *value = (int)v;
+    return p;
+}
+
+unsigned char *pack_varint(unsigned char *p, unsigned value) {
+    while (value >= 0x80) {
+        *p++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (unsigned char)value;
+    return p;
+}
+
+// Decode one packed run - a byte of colour << 4 | length (0 if the length is too big and follows as a
+// varint), then the gap since the last run ended as a varint. Returns the next run.
+const unsigned char *unpack_run(const unsigned char *p, Run *run, int last_end) {
+    run->pair = *p >> 4;
+    run->len = *p++ & 0x0F;
+    if (!run->len) p = unpack_varint(p, &run->len);
+    int gap;
+    p = unpack_varint(p, &gap);
+    run->start = last_end + gap;
+    return p;
+}
+
+// Read a varint that has to end before end and fit in an int, moving p past it. Returns false if it does not.
+int check_varint(const unsigned char **p, const unsigned char *end, unsigned long long *value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 35; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *value |= (unsigned long long)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return *value <= INT_MAX;
+    }
+    return 0;
+}
+
+// Whether n bytes of packed runs from outside, such as a cache file, are whole runs that all end within
+// len columns - so unpack_run() never reads past them, and no run's start or length comes out negative
+int runs_check(const unsigned char *p, size_t n, unsigned len) {
+    const unsigned char *end = p + n;
+    unsigned long long last_end = 0;
+    while (p < end) {
+        unsigned long long run_len = *p++ & 0x0F;
+        unsigned long long gap;
+        if (!run_len && !check_varint(&p, end, &run_len)) return 0;
+        if (!check_varint(&p, end, &gap)) return 0;
+        last_end += gap + run_len;
+        if (last_end > len) return 0;
+    }
+    return 1;
+}
+
+// Unpack a row's runs into the scratch from index n, moved along by offset columns. Returns the number of
+// runs now in the scratch.
+int runs_unpack(Row *row, int n, int offset) {
+    const unsigned char *p = row->runs;
+    const unsigned char *end = row->runs + row->run_len;
+    int last_end = 0;
+    while (p < end) {
+        Run run;
+        p = unpack_run(p, &run, last_end);
+        last_end = run.start + run.len;
+        n = run_push(n, run.start + offset, run.len, run.pair);
+    }
+    return n;
+}
+
+// Pack n runs into the pack scratch. Returns the number of bytes.
+int runs_encode(const Run *runs, int n) {
+    if (pack_scratch_cap < n * 11) {
+        pack_scratch_cap = n * 22;
+        pack_scratch = realloc(pack_scratch, pack_scratch_cap);
+    }
+    unsigned char *p = pack_scratch;
+    int last_end = 0;
+    for (int i = 0; i < n; i++) {
+        *p++ = (unsigned char)(runs[i].pair << 4 | (runs[i].len < 16 ? runs[i].len : 0));
+        if (runs[i].len >= 16) p = pack_varint(p, runs[i].len);
+        p = pack_varint(p, runs[i].start - last_end);
+        last_end = runs[i].start + runs[i].len;
+    }
+    return (int)(p - pack_scratch);
+}
+
+// Store len bytes of packed runs as the row's runs. Runs that fit stay where they are - otherwise a row's
+// first runs get an exact-sized slab block and later ones come from the pool.
+void runs_store(Arena *arena, Row *row, const unsigned char *packed, int len) {
+    // Runs out of the cache are read-only, so they are always replaced
+    if (len > row->run_cap || row->run_store == ROW_MAPPED) {
+        int mapped = row->run_store == ROW_MAPPED;
+        runs_free(arena, row);
+        int class = pool_class(len);
+        if (!row->run_cap || mapped) {
+            row->run_cap = len;
+            row->runs = arena_alloc(arena, len);
+            row->run_store = ROW_SLAB;
+        } else if (class >= 0) {
+            row->run_cap = POOL_MIN << class;
+            row->runs = pool_alloc(arena, class);
+            row->run_store = ROW_POOL;
+        } else {
+            row->run_cap = len * 2;
+            row->runs = malloc(row->run_cap);
+            row->run_store = ROW_HEAP;
+        }
+    }
+    if (len) memcpy(row->runs, packed, len);
+    row->run_len = len;
+}
+
+// Store n runs from the scratch as the row's runs
+void runs_pack(Arena *arena, Row *row, const Run *runs, int n) {
+    runs_store(arena, row, pack_scratch, runs_encode(runs, n));
+}
+
+// Colour n characters from x - runs inside them go and runs they cut are trimmed
+void row_paint(Arena *arena, Row *row, int x, int n, int pair) {
+    if (n <= 0) return;
+    int end = x + n;
+    int count = runs_unpack(row, 0, 0);
+    int first = 0;
+    while (first < count && run_scratch[first].start + run_scratch[first].len <= x) first++;
+    int last = first; // One past the last run overlapping x..end
+    while (last < count && run_scratch[last].start < end) last++;
+
+    // What is left of the runs either side, and the new run between them
+    Run pieces[3];
+    int new_count = 0;
+    if (last > first && run_scratch[first].start < x) {
+        pieces[new_count] = run_scratch[first];
+        pieces[new_count++].len = x - run_scratch[first].start;
+    }
+    if (pair != PAIR_BODY && pair != 0) pieces[new_count++] = (Run){x, n, pair};
+    if (last > first) {
+        Run tail = run_scratch[last - 1];
+        if (tail.start + tail.len > end) pieces[new_count++] = (Run){end, tail.start + tail.len - end, tail.pair};
+    }
+
+    // Make room for the pieces, then put them in place of first..last
+    while (run_scratch_cap < count + 3) {
+        run_scratch_cap = run_scratch_cap * 2 + 64;
+        run_scratch = realloc(run_scratch, sizeof(Run) * run_scratch_cap);
+    }
+    memmove(&run_scratch[first + new_count], &run_scratch[last], sizeof(Run) * (count - last));
+    memcpy(&run_scratch[first], pieces, sizeof(Run) * new_count);
+    runs_pack(arena, row, run_scratch, count + new_count - (last - first));
+}
+
+// Colours of len characters from x, one byte per character, for drawing
+void row_colours(Row *row, int x, char *syntax, int len) {
+    memset(syntax, PAIR_BODY, len);
+    const unsigned char *p = row->runs;
+    const unsigned char *end = row->runs + row->run_len;
+    int last_end = 0;
+    while (p < end) {
+        Run run;
+        p = unpack_run(p, &run, last_end);
+        last_end = run.start + run.len;
+        if (run.start >= x + len) break;
+        if (last_end <= x) continue;
+        int from = run.start > x ? run.start : x;
+        int to = last_end < x + len ? last_end : x + len;
+        memset(syntax + from - x, run.pair, to - from);
+    }
+}
+
+// n characters have been inserted at x - they take the colour of a run they land inside, otherwise they are
+// PAIR_BODY, until the row is re-highlighted
+void runs_insert(Arena *arena, Row *row, int x, int n) {
+    if (!row->run_len) return;
+    int count = runs_unpack(row, 0, 0);
+    for (int i = 0; i < count; i++) {
+        if (run_scratch[i].start >= x) run_scratch[i].start += n;
+        else if (run_scratch[i].start + run_scratch[i].len > x) run_scratch[i].len += n;
+    }
+    runs_pack(arena, row, run_scratch, count);
+}
+
+// n characters have been deleted from x - runs are clipped to what is left of them and closed up
+void runs_delete(Arena *arena, Row *row, int x, int n) {
+    if (!row->run_len) return;
+    int end = x + n;
+    int count = runs_unpack(row, 0, 0);
+    int out = 0;
+    for (int i = 0; i < count; i++) {
+        Run run = run_scratch[i];
+        int run_end = run.start + run.len;
+        int before = run.start < x ? (run_end < x ? run_end : x) - run.start : 0;
+        int after = run_end > end ? run_end - (run.start > end ? run.start : end) : 0;
+        if (before + after == 0) continue;
+        run.start = run.start < x ? run.start : run.start > end ? run.start - n : x;
+        run.len = before + after;
+        run_scratch[out++] = run;
+    }
+    runs_pack(arena, row, run_scratch, out);
+}
+
+// Move the runs from column x on to new_row, which has none yet, as the row is split at x
+void runs_split(Arena *arena, Row *row, Row *new_row, int x) {
+    if (!row->run_len) return;
+    int count = runs_unpack(row, 0, 0);
+    int i = 0;
+    while (i < count && run_scratch[i].start + run_scratch[i].len <= x) i++;
+    // The run the split cuts keeps its first part, and its second part starts the new row
+    if (i < count && run_scratch[i].start < x) {
+        int cut_end = run_scratch[i].start + run_scratch[i].len;
+        run_scratch[i].len = x - run_scratch[i].start;
+        runs_pack(arena, row, run_scratch, i + 1);
+        run_scratch[i].start = x;
+        run_scratch[i].len = cut_end - x;
+    } else runs_pack(arena, row, run_scratch, i);
+    for (int j = i; j < count; j++) run_scratch[j].start -= x;
+    runs_pack(arena, new_row, run_scratch + i, count - i);
+}
+
+// Add the runs of src after the runs of row, moved along by offset columns
+void runs_append(Arena *arena, Row *row, Row *src, int offset) {
+    if (!src->run_len) return;
+    int count = runs_unpack(src, runs_unpack(row, 0, 0), offset);
+    runs_pack(arena, row, run_scratch, count);
+}
+
+// Create a row holding a copy of len characters, not yet highlighted
+void row_init(Arena *arena, Row *row, const char *chars, int len) {
+    row->cap = len;
+    row->len = len;
+    row->gap = len;
+    row->runs = NULL;
+    row->run_len = 0;
+    row->run_cap = 0;
+    row->run_store = ROW_SLAB;
+    row->state = LEX_UNKNOWN;
+    row->remote = 0;
+    // An exact-sized block - a gap is only opened once the row is edited
+    row->store = ROW_SLAB;
+    row->chars = arena_alloc(arena, row->cap);
+    memcpy(row->chars, chars, len);
+}
+
+// Make a row that is a view of len characters owned by someone else
+void row_view(Row *row, char *chars, int len) {
+    row->chars = chars;
+    row->cap = len;
+    row->len = len;
+    row->gap = len;
+    row->runs = NULL;
+    row->run_len = 0;
+    row->run_cap = 0;
+    row->run_store = ROW_SLAB;
+    row->state = LEX_UNKNOWN;
+    row->store = ROW_MAPPED;
+    row->remote = 0;
+}
+
+// Give a row's storage back - slab blocks are only reclaimed when the whole arena is freed
+void row_free(Arena *arena, Row *row) {
+    if (row->store == ROW_POOL) pool_release(arena, row->chars, pool_class(row->cap));
+    else if (row->store == ROW_HEAP) free(row->chars);
+    runs_free(arena, row);
+}
+
+// Move the gap so that it starts at x
+void row_move_gap(Row *row, int x) {
+    int gap_len = row->cap - row->len;
+    if (gap_len == 0) {
+        // Nothing to move - also keeps mapped rows, which never have a gap, read-only
+    } else if (x < row->gap) {
+        // Characters between x and the gap move to the other side of it
+        memmove(row->chars + x + gap_len, row->chars + x, row->gap - x);
+    } else if (x > row->gap) {
+        memmove(row->chars + row->gap, row->chars + row->gap + gap_len, x - row->gap);
+    }
+    row->gap = x;
+}
+
+// Make sure the gap has room for at least n more characters. A mapped row is always copied out,
+// so this is also how a row is made writable before it is edited.
+void row_reserve(Arena *arena, Row *row, int n) {
+    if (row->cap - row->len >= n && row->store != ROW_MAPPED) return;
+
+    int cap = row->cap * 2;
+    if (cap < row->len + n) cap = row->len + n;
+    if (cap < row->len + ROW_MIN_GAP) cap = row->len + ROW_MIN_GAP;
+
+    char *chars;
+    int store;
+    int class = pool_class(cap);
+    if (class >= 0) {
+        // Round up to use the whole pool block
+        cap = POOL_MIN << class;
+        chars = pool_alloc(arena, class);
+        store = ROW_POOL;
+    } else {
+        chars = malloc(cap);
+        store = ROW_HEAP;
+    }
+    int tail = row->len - row->gap;
+    memcpy(chars, row->chars, row->gap);
+    memcpy(chars + cap - tail, row->chars + row->cap - tail, tail);
+    if (row->store == ROW_POOL) pool_release(arena, row->chars, pool_class(row->cap));
+    else if (row->store == ROW_HEAP) free(row->chars);
+
+    row->chars = chars;
+    row->cap = cap;
+    row->store = (unsigned char)store;
+}
+
+// Move the gap to the end so chars[0..len) can be read directly
+void row_flatten(Row *row) {
+    row_move_gap(row, row->len);
+}
+
+// Insert n characters at x
+void row_insert(Arena *arena, Row *row, int x, const char *chars, int n) {
+    row_reserve(arena, row, n);
+    row_move_gap(row, x);
+    memcpy(row->chars + x, chars, n);
+    row->gap += n;
+    row->len += n;
+    runs_insert(arena, row, x, n);
+}
+
+// Delete n characters starting at x - the gap simply grows over them
+void row_delete(Arena *arena, Row *row, int x, int n) {
+    row_reserve(arena, row, 0);
+    row_move_gap(row, x);
+    row->len -= n;
+    runs_delete(arena, row, x, n);
+}
+
+Row *buffer_row(TextBuffer *buffer, int y) {
+    return &buffer->rows[y < buffer->row_gap ? y : y + buffer->row_cap - buffer->num_rows];
+}
+
+// Move the row array's gap so that it starts at row y
+void buffer_move_gap(TextBuffer *buffer, int y) {
+    int gap_len = buffer->row_cap - buffer->num_rows;
+    if (y < buffer->row_gap) {
+        memmove(&buffer->rows[y + gap_len], &buffer->rows[y], sizeof(Row) * (buffer->row_gap - y));
+    } else if (y > buffer->row_gap) {
+        memmove(&buffer->rows[buffer->row_gap], &buffer->rows[buffer->row_gap + gap_len], sizeof(Row) * (y - buffer->row_gap));
+    }
+    buffer->row_gap = y;
+}
+
+// Grow the row array to hold cap rows
+void buffer_reserve_rows(TextBuffer *buffer, int cap) {
+    if (cap <= buffer->row_cap) return;
+    buffer->rows = realloc(buffer->rows, sizeof(Row) * cap);
+    // The rows after the gap move up to the new end
+    int tail = buffer->num_rows - buffer->row_gap;
+    memmove(&buffer->rows[cap - tail], &buffer->rows[buffer->row_cap - tail], sizeof(Row) * tail);
+    buffer->row_cap = cap;
+}
+
+// Add rows start..end (inclusive) to the range whose text or colours have changed
+void mark_changed(TextBuffer *buffer, int start, int end) {
+    if (buffer->changed_start < 0) {
+        buffer->changed_start = start;
+        buffer->changed_end = end;
+        buffer->changed_rows = 0;
+        return;
+    }
+    if (start < buffer->changed_start) buffer->changed_start = start;
+    if (end > buffer->changed_end) buffer->changed_end = end;
+}
+
+// Keep the changed range covering a row inserted at y (delta 1) or deleted (delta -1), and count it, so the
+// rows after the range still line up with the same rows before the changes
+void changed_shift(TextBuffer *buffer, int y, int delta) {
+    if (buffer->changed_start < 0) {
+        buffer->changed_start = y;
+        buffer->changed_end = y + (delta > 0 ? 0 : -1);
+        buffer->changed_rows = delta;
+        return;
+    }
+    if (y < buffer->changed_start) buffer->changed_start = y;
+    if (y <= buffer->changed_end) buffer->changed_end += delta;
+    else buffer->changed_end = y + (delta > 0 ? 0 : -1);
+    buffer->changed_rows += delta;
+}
+
+// Add rows start..end (inclusive) to the range waiting to be re-highlighted
+void mark_dirty(TextBuffer *buffer, int start, int end) {
+    mark_changed(buffer, start, end);
+    if (buffer->dirty_start < 0) {
+        buffer->dirty_start = start;
+        buffer->dirty_end = end;
+        return;
+    }
+    if (start < buffer->dirty_start) buffer->dirty_start = start;
+    if (end > buffer->dirty_end) buffer->dirty_end = end;
+}
+
+// Keep the dirty range on the same rows when a row at y is inserted (delta 1) or deleted (delta -1) before
+// it is highlighted, as it will be after several edits made in one go
+void dirty_shift(TextBuffer *buffer, int y, int delta) {
+    if (buffer->dirty_start < 0) return;
+    if (y < buffer->dirty_start) buffer->dirty_start += delta;
+    if (y <= buffer->dirty_end) buffer->dirty_end += delta;
+    if (buffer->dirty_start < 0) buffer->dirty_start = 0;
+    if (buffer->dirty_end < buffer->dirty_start) buffer->dirty_end = buffer->dirty_start;
+}
+
+// Keep the rows of jobs out with the highlight thread lined up with the buffer when a row at y is inserted
+// (delta 1) or deleted (delta -1). A job the change lands in the middle of can no longer be trusted to
+// cover the rows it was sent for, so they are all marked dirty again.
+void jobs_sent_shift(TextBuffer *buffer, int y, int delta) {
+    for (int i = 0; i < buffer->num_jobs_sent; i++) {
+        HighlightJob *job = buffer->jobs_sent[i];
+        if (y < job->y || (delta > 0 && y == job->y)) job->y += delta;
+        else if (y < job->y + job->num_rows) mark_dirty(buffer, job->y, job->y + job->num_rows);
+    }
+}
+
+// Open up a new (uninitialised) row at y and return it - the caller must row_init() it.
+// Any Row pointers taken before this call are no longer valid.
+Row *buffer_insert_row(TextBuffer *buffer, int y) {
+    if (buffer->row_cap == buffer->num_rows) {
+        int cap = buffer->row_cap * 2;
+        if (cap < buffer->num_rows + BUFFER_MIN_GAP) cap = buffer->num_rows + BUFFER_MIN_GAP;
+        buffer_reserve_rows(buffer, cap);
+    }
+    buffer_move_gap(buffer, y);
+    buffer->row_gap++;
+    buffer->num_rows++;
+    // Rows below have shifted down - the new row itself is left for the caller to mark dirty
+    if (y < buffer->hl_valid) buffer->hl_valid++;
+    dirty_shift(buffer, y, 1);
+    jobs_sent_shift(buffer, y, 1);
+    changed_shift(buffer, y, 1);
+    return &buffer->rows[y];
+}
+
+// Remove row y. Any Row pointers taken before this call are no longer valid.
+void buffer_delete_row(TextBuffer *buffer, int y) {
+    row_free(&buffer->arena, buffer_row(buffer, y));
+    buffer_move_gap(buffer, y);
+    buffer->num_rows--;
+    if (y < buffer->hl_valid) buffer->hl_valid--;
+    dirty_shift(buffer, y, -1);
+    jobs_sent_shift(buffer, y, -1);
+    changed_shift(buffer, y, -1);
+}
+
+// Character class of one byte for the dummy highlighter (ASCII rules, as the editor runs in the C locale)
+static inline char classify_char(unsigned char c) {
+    if (isspace(c)) return PAIR_BODY;
+    if (isdigit(c)) return PAIR_NUM;
+    if (isalpha(c) || c == '_') return PAIR_VARIABLE;
+    return PAIR_OPERATOR;
+}
+
+#if defined(__AVX2__)
+#define CLASSIFY_BLOCK 32
+// Bytes in lo..hi - unsigned, via a saturating subtract
+static inline __m256i block_in_range(__m256i c, char lo, char hi) {
+    __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_subs_epu8(d, _mm256_set1_epi8((char)(hi - lo))), _mm256_setzero_si256());
+}
+
+static inline void classify_block(const char *chars, char *syntax) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)chars);
+    __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')), block_in_range(c, '\t', '\r'));
+    __m256i digit = block_in_range(c, '0', '9');
+    __m256i alpha = _mm256_or_si256(block_in_range(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), 'a', 'z'),
+                                    _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_')));
+    __m256i out = _mm256_set1_epi8(PAIR_OPERATOR);
+    out = _mm256_blendv_epi8(out, _mm256_set1_epi8(PAIR_BODY), space);
+    out = _mm256_blendv_epi8(out, _mm256_set1_epi8(PAIR_NUM), digit);
+    out = _mm256_blendv_epi8(out, _mm256_set1_epi8(PAIR_VARIABLE), alpha);
+    _mm256_storeu_si256((__m256i *)syntax, out);
+}
+
+#elif defined(__SSE2__)
+#define CLASSIFY_BLOCK 16
+static inline __m128i block_in_range(__m128i c, char lo, char hi) {
+    __m128i d = _mm_sub_epi8(c, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_subs_epu8(d, _mm_set1_epi8((char)(hi - lo))), _mm_setzero_si128());
+}
+
+// SSE2 has no byte blend - the class masks never overlap so they can just be or'd together
+static inline void classify_block(const char *chars, char *syntax) {
+    __m128i c = _mm_loadu_si128((const __m128i *)chars);
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')), block_in_range(c, '\t', '\r'));
+    __m128i digit = block_in_range(c, '0', '9');
+    __m128i alpha = _mm_or_si128(block_in_range(_mm_or_si128(c, _mm_set1_epi8(0x20)), 'a', 'z'),
+                                 _mm_cmpeq_epi8(c, _mm_set1_epi8('_')));
+    __m128i other = _mm_or_si128(_mm_or_si128(space, digit), alpha);
+    __m128i out = _mm_andnot_si128(other, _mm_set1_epi8(PAIR_OPERATOR));
+    out = _mm_or_si128(out, _mm_and_si128(space, _mm_set1_epi8(PAIR_BODY)));
+    out = _mm_or_si128(out, _mm_and_si128(digit, _mm_set1_epi8(PAIR_NUM)));
+    out = _mm_or_si128(out, _mm_and_si128(alpha, _mm_set1_epi8(PAIR_VARIABLE)));
+    _mm_storeu_si128((__m128i *)syntax, out);
+}
+
+#elif defined(__ARM_NEON)
+#define CLASSIFY_BLOCK 16
+static inline uint8x16_t block_in_range(uint8x16_t c, uint8_t lo, uint8_t hi) {
+    return vcleq_u8(vsubq_u8(c, vdupq_n_u8(lo)), vdupq_n_u8((uint8_t)(hi - lo)));
+}
+
+static inline void classify_block(const char *chars, char *syntax) {
+    uint8x16_t c = vld1q_u8((const uint8_t *)chars);
+    uint8x16_t space = vorrq_u8(vceqq_u8(c, vdupq_n_u8(' ')), block_in_range(c, '\t', '\r'));
+    uint8x16_t digit = block_in_range(c, '0', '9');
+    uint8x16_t alpha = vorrq_u8(block_in_range(vorrq_u8(c, vdupq_n_u8(0x20)), 'a', 'z'), vceqq_u8(c, vdupq_n_u8('_')));
+    uint8x16_t out = vdupq_n_u8(PAIR_OPERATOR);
+    out = vbslq_u8(space, vdupq_n_u8(PAIR_BODY), out);
+    out = vbslq_u8(digit, vdupq_n_u8(PAIR_NUM), out);
+    out = vbslq_u8(alpha, vdupq_n_u8(PAIR_VARIABLE), out);
+    vst1q_u8((uint8_t *)syntax, out);
+}
+#endif
+
+// Classify len characters a vector block at a time, with a scalar fallback when there is no SIMD
+void classify_chars(const char *chars, char *syntax, int len) {
+    int j = 0;
+#ifdef CLASSIFY_BLOCK
+    if (len >= CLASSIFY_BLOCK) {
+        for (; j + CLASSIFY_BLOCK <= len; j += CLASSIFY_BLOCK) {
+            classify_block(chars + j, syntax + j);
+        }
+        // The tail is finished with one more block that overlaps the last - reclassifying is harmless
+        if (j < len) classify_block(chars + len - CLASSIFY_BLOCK, syntax + len - CLASSIFY_BLOCK);
+        return;
+    }
+#endif
+    for (; j < len; j++) {
+        syntax[j] = classify_char((unsigned char)chars[j]);
+    }
+}
+
+// Scratch for classifying a row a byte per character before it is stored as runs
+_Thread_local char *classify_scratch;
+_Thread_local int classify_scratch_cap;
+
+// Free the calling thread's scratch buffers - the library's own threads do this as they finish
+void scratch_free(void) {
+    free(classify_scratch);
+    free(run_scratch);
+    free(pack_scratch);
+    classify_scratch = NULL;
+    run_scratch = NULL;
+    pack_scratch = NULL;
+    classify_scratch_cap = run_scratch_cap = pack_scratch_cap = 0;
+}
+
+// Simple Dummy Highlighter - handles # comments, /* block comments */, "strings", whitespace, numbers and symbols.
+// Used for files no generated lexer claims.
+int highlight_default(const Language *language, const char *chars, int len, int state, char *syntax) {
+    (void)language;
+    for (int i = 0; i < len;) {
+        int start = i;
+        if (state == LEX_STRING) {
+            // Up to and including the closing quote
+            while (i < len && chars[i] != '"') i += chars[i] == '\\' ? 2 : 1;
+            if (i < len) {
+                i++;
+                state = LEX_NORMAL;
+            }
+            if (i > len) i = len;
+            memset(syntax + start, PAIR_STRING, i - start);
+        } else if (state == LEX_COMMENT) {
+            while (i < len && !(chars[i] == '*' && i + 1 < len && chars[i + 1] == '/')) i++;
+            if (i < len) {
+                i += 2;
+                state = LEX_NORMAL;
+            }
+            memset(syntax + start, PAIR_COMMENT, i - start);
+        } else {
+            // Plain code is classified a block at a time up to whatever starts a comment or string
+            while (i < len && chars[i] != '#' && chars[i] != '"' && !(chars[i] == '/' && i + 1 < len && chars[i + 1] == '*')) i++;
+            classify_chars(chars + start, syntax + start, i - start);
+            if (i == len) break;
+            if (chars[i] == '#') {
+                memset(syntax + i, PAIR_COMMENT, len - i);
+                break;
+            }
+            // The opening quote or /* is coloured along with what it opens
+            int open = chars[i] == '"' ? 1 : 2;
+            memset(syntax + i, open == 1 ? PAIR_STRING : PAIR_COMMENT, open);
+            i += open;
+            state = open == 1 ? LEX_STRING : LEX_COMMENT;
+        }
+    }
+    return state;
+}
+
+// FNV-1a over a word, in lower case if fold is set - must match keyword_hash() in lexgen.c
+static inline unsigned long long keyword_hash(const char *s, int len, int fold) {
+    unsigned long long h = 0xCBF29CE484222325ull;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (fold && c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 0x100000001B3ull;
+    }
+    return h;
+}
+
+// Slot of a word with hash h in a bucket displaced by d - must match keyword_slot() in lexgen.c
+static inline unsigned keyword_slot(unsigned long long h, unsigned d, unsigned n) {
+    h += d * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 31)) * 0xBF58476D1CE4E5B9ull;
+    return (unsigned)((h ^ (h >> 29)) % n);
+}
+
+// Colour of a token that may be a keyword - the only keyword it can be is the one in its hash slot
+static inline int keyword_pair(const Dfa *dfa, const char *chars, int len, int pair) {
+    unsigned long long h = keyword_hash(chars, len, dfa->fold);
+    unsigned slot = keyword_slot(h, dfa->displace[h % (unsigned)dfa->buckets], (unsigned)dfa->num_keywords);
+    const char *keyword = dfa->keywords[slot];
+    int same = dfa->fold ? strncasecmp(keyword, chars, len) == 0 : strncmp(keyword, chars, len) == 0;
+    return same && keyword[len] == '\0' ? dfa->keyword_pairs[slot] : pair;
+}
+
+// Run a generated lexer - each token is the longest run of characters with a move out of the state before
+int highlight_dfa(const Language *language, const char *chars, int len, int state, char *syntax) {
+    const Dfa *dfa = &language->dfa;
+    if (!len) return state;
+    int s = state == LEX_NORMAL ? DFA_START : state;
+    for (int i = 0;;) {
+        int start = i;
+        for (int next; i < len && (next = dfa->next[s * dfa->columns + dfa->classes[(unsigned char)chars[i]]]); i++) {
+            s = next;
+        }
+        int pair = dfa->pairs[s];
+        if (dfa->num_keywords && i - start <= dfa->keyword_max && dfa->keyword_states[s]) {
+            pair = keyword_pair(dfa, chars + start, i - start, pair);
+        }
+        memset(syntax + start, pair, i - start);
+        if (i == len) return dfa->carry[s];
+        s = DFA_START;
+    }
+}
+
+#include "lexers.h"
+
+// The default is last, so a name or extension nothing else has ends up with it
+const Language LANGUAGES[] = {
+    GENERATED_LANGUAGES
+    {"default", "", highlight_default, {0}, 0, LEX_COMMENT + 1},
+};
+#define NUM_LANGUAGES ((int)(sizeof(LANGUAGES) / sizeof(LANGUAGES[0])))
+
+// The language called name, or NULL if there is none
+const Language *language_named(const char *name) {
+    for (int i = 0; i < NUM_LANGUAGES; i++) {
+        if (strcmp(LANGUAGES[i].name, name) == 0) return &LANGUAGES[i];
+    }
+    return NULL;
+}
+
+// The language for a file, by its extension
+const Language *language_for_file(const char *filename) {
+    const char *base = strrchr(filename, '/');
+    const char *dot = strrchr(base ? base : filename, '.');
+    if (dot) {
+        size_t n = strlen(dot);
+        for (int i = 0; i < NUM_LANGUAGES - 1; i++) {
+            for (const char *e = LANGUAGES[i].extensions; *e;) {
+                size_t len = strcspn(e, " ");
+                if (len == n && strncmp(e, dot, n) == 0) return &LANGUAGES[i];
+                e += len;
+                e += strspn(e, " ");
+            }
+        }
+    }
+    return &LANGUAGES[NUM_LANGUAGES - 1];
+}
+
+unsigned long long hash_mix(unsigned long long h, unsigned long long word) {
+    h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+    return h ^ (h >> 32);
+}
+
+// Hash of a row's text, a word at a time
+unsigned long long row_hash(const char *chars, int len) {
+    unsigned long long h = 0x9E3779B97F4A7C15ull;
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long word;
+        memcpy(&word, chars + i, 8);
+        h = hash_mix(h, word);
+    }
+    unsigned long long tail = 0;
+    if (i < len) memcpy(&tail, chars + i, len - i);
+    return hash_mix(hash_mix(h, tail), (unsigned long long)len);
+}
+
+// Changes whenever highlighting with the language might
+unsigned long long cache_version(const Language *language) {
+    unsigned long long h = hash_mix(CACHE_FORMAT, language->version);
+    return hash_mix(h, row_hash(language->name, (int)strlen(language->name)));
+}
+
+// The file a file's highlighting is cached in, named by a hash of its absolute path, which goes in key
+void cache_key(const char *cache_dir, const char *filename, char *path, size_t size, char *key) {
+    if (!realpath(filename, key)) snprintf(key, PATH_MAX, "%s", filename);
+    snprintf(path, size, "%s/%016llx.hlc", cache_dir, row_hash(key, (int)strlen(key)));
+}
+
+void cache_path(const char *cache_dir, const char *filename, char *path, size_t size) {
+    char key[PATH_MAX];
+    cache_key(cache_dir, filename, path, size, key);
+}
+
+unsigned cache_slot(unsigned long long hash, int state) {
+    return (unsigned)hash_mix(hash, (unsigned long long)state);
+}
+
+// The cached row with this text, len characters long, and start state, NULL if there is none
+const CacheRow *cache_find(const TextBuffer *buffer, unsigned long long hash, int len, int state) {
+    const CacheHeader *header = (const CacheHeader *)buffer->cache;
+    const CacheRow *rows = (const CacheRow *)(header + 1);
+    const unsigned *slots = (const unsigned *)(rows + header->num_rows);
+    unsigned mask = header->num_slots - 1;
+    unsigned i = cache_slot(hash, state) & mask;
+    for (unsigned probes = 0; probes < header->num_slots && slots[i]; probes++, i = (i + 1) & mask) {
+        const CacheRow *row = &rows[slots[i] - 1];
+        if (row->hash == hash && row->len == (unsigned)len && row->start_state == state) return row;
+    }
+    return NULL;
+}
+
+// Where the packed runs start in a cache file
+size_t cache_runs_start(const CacheHeader *header) {
+    return sizeof(CacheHeader) + (size_t)header->num_rows * sizeof(CacheRow) + (size_t)header->num_slots * sizeof(unsigned);
+}
+
+// Give a row its cached runs, straight out of the mapping - the caller sets its state
+void cache_install(TextBuffer *buffer, Row *row, const CacheRow *cached) {
+    // Better colours from the highlighter process are kept until the row is edited
+    if (row->remote) return;
+    runs_free(&buffer->arena, row);
+    row->runs = (unsigned char *)buffer->cache + cache_runs_start((const CacheHeader *)buffer->cache) + cached->runs;
+    row->run_len = row->run_cap = (int)cached->run_len;
+    row->run_store = ROW_MAPPED;
+}
+
+// Map the freshly loaded file's cache, if it has one that fits, and install the rows it has from the top
+// down for as long as they are found
+void cache_load(TextBuffer *buffer) {
+    char path[PATH_MAX + 32];
+    char key[PATH_MAX];
+    cache_key(buffer->cache_dir, buffer->filename, path, sizeof(path), key);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CacheHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    const CacheHeader *header = (const CacheHeader *)map;
+    const CacheRow *rows = (const CacheRow *)(header + 1);
+    int fits = memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+               header->version == cache_version(buffer->language) &&
+               strncmp(header->path, key, sizeof(header->path)) == 0 && header->num_slots &&
+               !(header->num_slots & (header->num_slots - 1)) && cache_runs_start(header) + header->runs_len == (size_t)st.st_size;
+    // Nothing in the file is taken on trust - a row's states index the lexer's tables, and its runs have to
+    // unpack to no more than its own characters
+    const unsigned char *packed = (const unsigned char *)map + (fits ? cache_runs_start(header) : 0);
+    int num_states = buffer->language->num_states;
+    for (unsigned i = 0; fits && i < header->num_rows; i++) {
+        fits = (unsigned long long)rows[i].runs + rows[i].run_len <= header->runs_len &&
+               rows[i].start_state < num_states && rows[i].state < num_states &&
+               runs_check(packed + rows[i].runs, rows[i].run_len, rows[i].len);
+    }
+    // Every slot has to be empty or name a row, or cache_find() would look outside the rows
+    const unsigned *slots = (const unsigned *)(rows + header->num_rows);
+    for (unsigned i = 0; fits && i < header->num_slots; i++) {
+        fits = slots[i] <= header->num_rows;
+    }
+    if (!fits) {
+        munmap(map, st.st_size);
+        return;
+    }
+    buffer->cache = map;
+    buffer->cache_len = st.st_size;
+
+    // A row in the same place with the same text and start state is the usual case, and costs no lookup
+    int state = LEX_NORMAL;
+    int y = 0;
+    for (; y < buffer->num_rows; y++) {
+        Row *row = buffer_row(buffer, y);
+        unsigned long long hash = row_hash(row->chars, row->len);
+        const CacheRow *cached = &rows[y];
+        if (y >= (int)header->num_rows || !cached->valid || cached->hash != hash || cached->len != (unsigned)row->len ||
+            cached->start_state != state) {
+            cached = cache_find(buffer, hash, row->len, state);
+            if (!cached) break;
+        }
+        cache_install(buffer, row, cached);
+        row->state = cached->state;
+        state = cached->state;
+    }
+    buffer->hl_valid = y;
+}
+
+// Write the buffer's highlighting to its cache, if every row is highlighted and nothing is still being
+// worked on. The new cache is written beside the old one and renamed over it, so a buffer still using the
+// old one or a crash part way through leaves nothing half written.
+void cache_save(TextBuffer *buffer) {
+    if (!buffer->cache_dir || !buffer->filename[0] || buffer->hl_valid < buffer->num_rows ||
+        buffer->dirty_start >= 0 || buffer->num_jobs_sent) return;
+    unsigned num_slots = 16;
+    while (num_slots < 2 * (unsigned)buffer->num_rows) num_slots *= 2;
+    CacheHeader header = {.magic = CACHE_MAGIC, .version = cache_version(buffer->language),
+                          .num_rows = (unsigned)buffer->num_rows, .num_slots = num_slots};
+    char path[PATH_MAX + 32];
+    cache_key(buffer->cache_dir, buffer->filename, path, sizeof(path), header.path);
+
+    // Rows with the same text and start state share their runs
+    CacheRow *rows = calloc(buffer->num_rows, sizeof(CacheRow));
+    unsigned *slots = calloc(num_slots, sizeof(unsigned));
+    unsigned char *runs = NULL;
+    size_t runs_cap = 0;
+    int state = LEX_NORMAL;
+    for (int y = 0; y < buffer->num_rows; y++) {
+        Row *row = buffer_row(buffer, y);
+        row_flatten(row);
+        CacheRow *cached = &rows[y];
+        cached->hash = row_hash(row->chars, row->len);
+        cached->len = (unsigned)row->len;
+        cached->start_state = (unsigned char)state;
+        cached->state = row->state;
+        cached->valid = !row->remote;
+        state = row->state;
+        if (!cached->valid) continue;
+
+        unsigned i = cache_slot(cached->hash, cached->start_state) & (num_slots - 1);
+        for (; slots[i]; i = (i + 1) & (num_slots - 1)) {
+            const CacheRow *other = &rows[slots[i] - 1];
+            if (other->hash == cached->hash && other->len == cached->len && other->start_state == cached->start_state) {
+                break;
+            }
+        }
+        if (slots[i]) {
+            cached->runs = rows[slots[i] - 1].runs;
+            cached->run_len = rows[slots[i] - 1].run_len;
+            continue;
+        }
+        slots[i] = y + 1;
+        if (header.runs_len + row->run_len > UINT_MAX) goto done;
+        if (header.runs_len + row->run_len > runs_cap) {
+            runs_cap = runs_cap * 2 + row->run_len + 4096;
+            runs = realloc(runs, runs_cap);
+        }
+        if (row->run_len) memcpy(runs + header.runs_len, row->runs, row->run_len);
+        cached->runs = (unsigned)header.runs_len;
+        cached->run_len = (unsigned)row->run_len;
+        header.runs_len += row->run_len;
+    }
+
+    // Nowhere to write it is not worth stopping for - it is rebuilt next time
+    mkdir(buffer->cache_dir, 0777);
+    char tmp_name[PATH_MAX + 64];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) goto done;
+    struct iovec iov[4] = {{&header, sizeof(header)}, {rows, sizeof(CacheRow) * buffer->num_rows},
+                           {slots, sizeof(unsigned) * num_slots}, {runs, header.runs_len}};
+    size_t total = 0;
+    for (int i = 0; i < 4; i++) total += iov[i].iov_len;
+    ssize_t written = writev(fd, iov, 4);
+    if (close(fd) != 0 || written != (ssize_t)total || rename(tmp_name, path) != 0) unlink(tmp_name);
+
+done:
+    free(rows);
+    free(slots);
+    free(runs);
+}
+
+// Highlights one row with the buffer's language, starting in the given lexer state, and returns the state
+// at the end of the row
+int highlight_row(TextBuffer *buffer, Row *line, int state) {
+    // A row still as it was loaded may be in the cache, with this start state
+    if (buffer->cache && line->store == ROW_MAPPED) {
+        const CacheRow *cached = cache_find(buffer, row_hash(line->chars, line->len), line->len, state);
+        if (cached) {
+            cache_install(buffer, line, cached);
+            return cached->state;
+        }
+    }
+    row_flatten(line);
+    if (line->len > classify_scratch_cap) {
+        classify_scratch_cap = line->len * 2;
+        classify_scratch = realloc(classify_scratch, classify_scratch_cap);
+    }
+    state = buffer->language->highlight(buffer->language, line->chars, line->len, state, classify_scratch);
+
+    // Better colours from the highlighter process are kept until the row is edited, but the end state is
+    // still needed to carry on into the next row
+    if (!line->remote) runs_pack(&buffer->arena, line, run_scratch, runs_from_syntax(0, 0, classify_scratch, line->len));
+    return state;
+}
+
+// Highlights rows start..end (inclusive), then carries on past end until a row's new end state matches
+// the one saved from the previous pass - from there on the rest of the buffer is already correct.
+// Rows past buffer->hl_valid are left for the background catch-up pass to correct.
+void highlight_syntax(TextBuffer *buffer, int start, int end) {
+    long long timer = stat_start();
+    if (start < 0) start = 0;
+    if (end >= buffer->num_rows) end = buffer->num_rows - 1;
+
+    // If the previous row has not been highlighted yet this is a best guess, fixed up by the catch-up pass
+    int state = start > 0 ? buffer_row(buffer, start - 1)->state : LEX_NORMAL;
+    if (state == LEX_UNKNOWN) state = LEX_NORMAL;
+    int in_order = start <= buffer->hl_valid;
+
+    int i = start;
+    for (; i < buffer->num_rows; i++) {
+        Row *row = buffer_row(buffer, i);
+        // Rows past end are only reached because the state they start in has changed (say a /* was typed
+        // above them), so colours from the highlighter process no longer fit them
+        if (i > end) row->remote = 0;
+        int new_state = highlight_row(buffer, row, state);
+        int old_state = row->state;
+        row->state = (unsigned char)new_state;
+        if (in_order && i >= buffer->hl_valid) buffer->hl_valid = i + 1;
+        if (i >= end && (new_state == old_state || i + 1 >= buffer->hl_valid)) break;
+        state = new_state;
+    }
+    mark_changed(buffer, start, i < buffer->num_rows ? i : buffer->num_rows - 1);
+    stat_record(STAT_HIGHLIGHT, timer);
+}
+
+// Make sure rows start..end (inclusive) have some highlighting - used for the screen and its prefetch margin
+void highlight_visible(TextBuffer *buffer, int start, int end) {
+    if (start < buffer->hl_valid) start = buffer->hl_valid;
+    if (end >= buffer->num_rows) end = buffer->num_rows - 1;
+
+    for (int i = start; i <= end; i++) {
+        if (buffer_row(buffer, i)->state != LEX_UNKNOWN) continue;
+        // Highlight the whole run of unhighlighted rows in one go
+        int run_end = i;
+        while (run_end < end && buffer_row(buffer, run_end + 1)->state == LEX_UNKNOWN) run_end++;
+        highlight_syntax(buffer, i, run_end);
+        i = run_end;
+    }
+}
+
+void *prehighlight_worker(void *arg) {
+    TextBuffer *buffer = arg;
+    const Language *language = buffer->language;
+    int k;
+    Prehighlight *prehighlight = &buffer->prehighlight;
+    while (!atomic_load(&prehighlight->stop) &&
+           (k = atomic_fetch_add(&prehighlight->next_chunk, 1)) < prehighlight->num_chunks) {
+        PreChunk *chunk = &prehighlight->chunks[k];
+        const char *first = buffer->map + chunk->start;
+        const char *end = buffer->map + chunk->end;
+        int rows_cap = 0;
+        size_t runs_cap = 0;
+        int state = LEX_NORMAL;
+        for (const char *p = first; p < end;) {
+            const char *nl = memchr(p, '\n', end - p);
+            if (!nl) nl = end;
+            int len = (int)(nl - p);
+            if (chunk->num_rows == rows_cap) {
+                rows_cap = rows_cap * 2 + 1024;
+                chunk->rows = realloc(chunk->rows, sizeof(PreRow) * rows_cap);
+            }
+            if (len > classify_scratch_cap) {
+                classify_scratch_cap = len * 2;
+                classify_scratch = realloc(classify_scratch, classify_scratch_cap);
+            }
+
+            PreRow *row = &chunk->rows[chunk->num_rows++];
+            row->offset = (unsigned)(p - first);
+            row->len = len;
+            row->start_state = (unsigned char)state;
+            state = language->highlight(language, p, len, state, classify_scratch);
+            row->state = (unsigned char)state;
+
+            int num_runs = runs_from_syntax(0, 0, classify_scratch, len);
+            int n = runs_encode(run_scratch, num_runs);
+            if (chunk->runs_len + n > runs_cap) {
+                runs_cap = runs_cap * 2 + n + 4096;
+                chunk->runs = realloc(chunk->runs, runs_cap);
+            }
+            memcpy(chunk->runs + chunk->runs_len, pack_scratch, n);
+            row->runs = (unsigned)chunk->runs_len;
+            chunk->runs_len += n;
+            p = nl + 1;
+        }
+        atomic_store(&chunk->done, 1);
+        // If the pipe is full the input loop is going to wake up anyway
+        if (write(prehighlight->wake[1], "", 1) < 0) continue;
+    }
+    scratch_free();
+    return NULL;
+}
+
+// Start highlighting a freshly loaded file in parallel, if it is big enough to be worth it
+void prehighlight_start(TextBuffer *buffer) {
+    Prehighlight *prehighlight = &buffer->prehighlight;
+    if (!buffer->map || buffer->map_len < 2 * PREHIGHLIGHT_CHUNK) return;
+    int threads = buffer->threads ? buffer->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > PREHIGHLIGHT_MAX_THREADS) threads = PREHIGHLIGHT_MAX_THREADS;
+    if (threads < 2) return;
+
+    // Chunks end at the end of a line
+    int cap = (int)(buffer->map_len / PREHIGHLIGHT_CHUNK) + 1;
+    prehighlight->chunks = calloc(cap, sizeof(PreChunk));
+    for (size_t start = 0; start < buffer->map_len;) {
+        size_t end = start + PREHIGHLIGHT_CHUNK;
+        if (end >= buffer->map_len) {
+            end = buffer->map_len;
+        } else {
+            char *nl = memchr(buffer->map + end, '\n', buffer->map_len - end);
+            end = nl ? (size_t)(nl - buffer->map) + 1 : buffer->map_len;
+        }
+        prehighlight->chunks[prehighlight->num_chunks].start = start;
+        prehighlight->chunks[prehighlight->num_chunks++].end = end;
+        start = end;
+    }
+
+    if (pipe(prehighlight->wake) != 0) die("pipe");
+    for (int i = 0; i < 2; i++) {
+        fcntl(prehighlight->wake[i], F_SETFL, O_NONBLOCK);
+        fcntl(prehighlight->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    prehighlight->running = 1;
+    if (threads > prehighlight->num_chunks) threads = prehighlight->num_chunks;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&prehighlight->threads[i], NULL, prehighlight_worker, buffer) != 0) break;
+        prehighlight->num_threads++;
+    }
+}
+
+// Stop the threads and drop whatever they have done
+void prehighlight_stop(TextBuffer *buffer) {
+    Prehighlight *prehighlight = &buffer->prehighlight;
+    if (!prehighlight->running) return;
+    atomic_store(&prehighlight->stop, 1);
+    for (int i = 0; i < prehighlight->num_threads; i++) pthread_join(prehighlight->threads[i], NULL);
+    for (int i = 0; i < prehighlight->num_chunks; i++) {
+        free(prehighlight->chunks[i].rows);
+        free(prehighlight->chunks[i].runs);
+    }
+    free(prehighlight->chunks);
+    close(prehighlight->wake[0]);
+    close(prehighlight->wake[1]);
+    memset(prehighlight, 0, sizeof(*prehighlight));
+}
+
+// Give row a thread's highlighting, if there is one for it starting in state. Returns 1 if it did, 0 if the
+// row has to be highlighted here, and -1 if a thread has yet to get to it.
+int prehighlight_install(TextBuffer *buffer, Row *row, int state) {
+    Prehighlight *prehighlight = &buffer->prehighlight;
+    if (!prehighlight->running || row->store != ROW_MAPPED) return 0;
+    size_t offset = (size_t)(row->chars - buffer->map);
+
+    // The last chunk that starts at or before the row, then the row in it
+    int lo = 0, hi = prehighlight->num_chunks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (prehighlight->chunks[mid].start <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+    PreChunk *chunk = &prehighlight->chunks[lo];
+    if (!atomic_load(&chunk->done)) return -1;
+    offset -= chunk->start;
+    lo = 0, hi = chunk->num_rows - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (chunk->rows[mid].offset <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+    if (hi < 0) return 0;
+    const PreRow *pre = &chunk->rows[lo];
+    if (pre->offset != offset || pre->len != row->len || pre->start_state != state) return 0;
+
+    size_t runs_end = lo + 1 < chunk->num_rows ? chunk->rows[lo + 1].runs : chunk->runs_len;
+    // Better colours from the highlighter process are kept until the row is edited
+    if (!row->remote) runs_store(&buffer->arena, row, chunk->runs + pre->runs, (int)(runs_end - pre->runs));
+    row->state = pre->state;
+    return 1;
+}
+
+// Background catch-up - highlight up to max_rows rows from the in-order frontier, using what the parallel
+// highlighting threads have done where it fits. Returns true while there are still rows left to do.
+int highlight_catch_up(TextBuffer *buffer, int max_rows) {
+    int end = buffer->hl_valid + max_rows;
+    if (end > buffer->num_rows) end = buffer->num_rows;
+
+    int i = buffer->hl_valid;
+    for (; i < end; i++) {
+        int state = i > 0 ? buffer_row(buffer, i - 1)->state : LEX_NORMAL;
+        Row *row = buffer_row(buffer, i);
+        int installed = prehighlight_install(buffer, row, state);
+        if (installed < 0) break;
+        if (!installed) row->state = (unsigned char)highlight_row(buffer, row, state);
+    }
+    buffer->prehighlight.waiting = i < end;
+    if (i > buffer->hl_valid) {
+        mark_changed(buffer, buffer->hl_valid, i - 1);
+        buffer->hl_valid = i;
+    }
+    if (buffer->hl_valid >= buffer->num_rows) prehighlight_stop(buffer);
+
+    return buffer->hl_valid < buffer->num_rows;
+}
+
+int queue_push(JobQueue *queue, HighlightJob *job) {
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == HIGHLIGHT_QUEUE) return 0;
+    queue->jobs[tail % HIGHLIGHT_QUEUE] = job;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+HighlightJob *queue_pop(JobQueue *queue) {
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) return NULL;
+    HighlightJob *job = queue->jobs[head % HIGHLIGHT_QUEUE];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return job;
+}
+
+void *highlight_thread(void *arg) {
+    HighlightWorker *worker = arg;
+    const Language *language = worker->language;
+    char byte;
+    while (read(worker->wake_thread[0], &byte, 1) == 1 && !atomic_load(&worker->stop)) {
+        HighlightJob *job;
+        while ((job = queue_pop(&worker->to_thread))) {
+            size_t cap = 0;
+            int state = job->start_state;
+            for (int r = 0; r < job->num_rows; r++) {
+                int len = job->offsets[r + 1] - job->offsets[r];
+                if (len > classify_scratch_cap) {
+                    classify_scratch_cap = len * 2;
+                    classify_scratch = realloc(classify_scratch, classify_scratch_cap);
+                }
+                state = language->highlight(language, job->text + job->offsets[r], len, state, classify_scratch);
+                job->states[r] = (unsigned char)state;
+
+                int num_runs = runs_from_syntax(0, 0, classify_scratch, len);
+                int n = runs_encode(run_scratch, num_runs);
+                if (job->packed_len + n > cap) {
+                    cap = cap * 2 + n + 1024;
+                    job->packed = realloc(job->packed, cap);
+                }
+                if (n) memcpy(job->packed + job->packed_len, pack_scratch, n);
+                job->runs[r] = (unsigned)job->packed_len;
+                job->packed_len += n;
+            }
+            job->runs[job->num_rows] = (unsigned)job->packed_len;
+            // Never full - no more jobs are sent than it has room for
+            queue_push(&worker->from_thread, job);
+            if (write(worker->wake[1], "", 1) < 0) continue;
+        }
+    }
+    scratch_free();
+    return NULL;
+}
+
+void highlight_worker_start(TextBuffer *buffer) {
+    HighlightWorker *worker = &buffer->worker;
+    worker->language = buffer->language;
+    atomic_store(&worker->stop, 0);
+    if (pipe(worker->wake_thread) != 0 || pipe(worker->wake) != 0) die("pipe");
+    for (int i = 0; i < 2; i++) {
+        fcntl(worker->wake_thread[i], F_SETFD, FD_CLOEXEC);
+        fcntl(worker->wake[i], F_SETFD, FD_CLOEXEC);
+        fcntl(worker->wake[i], F_SETFL, O_NONBLOCK);
+    }
+    worker->running = pthread_create(&worker->thread, NULL, highlight_thread, worker) == 0;
+    if (!worker->running) {
+        // Everything is highlighted here instead
+        for (int i = 0; i < 2; i++) {
+            close(worker->wake_thread[i]);
+            close(worker->wake[i]);
+        }
+    }
+}
+
+void highlight_worker_stop(TextBuffer *buffer) {
+    HighlightWorker *worker = &buffer->worker;
+    if (!worker->running) return;
+    atomic_store(&worker->stop, 1);
+    if (write(worker->wake_thread[1], "", 1) < 0) die("write");
+    pthread_join(worker->thread, NULL);
+    worker->running = 0;
+    HighlightJob *job;
+    while ((job = queue_pop(&worker->to_thread)) || (job = queue_pop(&worker->from_thread))) {
+        free(job->packed);
+        free(job);
+    }
+    buffer->num_jobs_sent = 0;
+    for (int i = 0; i < 2; i++) {
+        close(worker->wake_thread[i]);
+        close(worker->wake[i]);
+    }
+}
+
+// Send rows start..end (inclusive) to the highlight thread. Returns false if it cannot take them all.
+int highlight_worker_send(TextBuffer *buffer, int start, int end) {
+    HighlightWorker *worker = &buffer->worker;
+    if (!worker->running || worker->language != buffer->language) return 0;
+    if (start < 0) start = 0;
+    if (end >= buffer->num_rows) end = buffer->num_rows - 1;
+    int jobs = (end - start) / HIGHLIGHT_JOB_ROWS + 1;
+    if (buffer->num_jobs_sent + jobs > HIGHLIGHT_QUEUE) return 0;
+
+    for (int y = start; y <= end; y += HIGHLIGHT_JOB_ROWS) {
+        int n = end - y + 1 < HIGHLIGHT_JOB_ROWS ? end - y + 1 : HIGHLIGHT_JOB_ROWS;
+        size_t text_len = 0;
+        for (int r = 0; r < n; r++) text_len += buffer_row(buffer, y + r)->len;
+
+        // One block for the job and its arrays, all but the packed runs
+        HighlightJob *job = malloc(sizeof(HighlightJob) + sizeof(int) * (n + 1) + sizeof(unsigned) * (n + 1) + n + text_len);
+        job->offsets = (int *)(job + 1);
+        job->runs = (unsigned *)(job->offsets + n + 1);
+        job->states = (unsigned char *)(job->runs + n + 1);
+        job->text = (char *)(job->states + n);
+        job->y = y;
+        job->num_rows = n;
+        int state = y > 0 ? buffer_row(buffer, y - 1)->state : LEX_NORMAL;
+        job->start_state = (unsigned char)(state == LEX_UNKNOWN ? LEX_NORMAL : state);
+        job->packed = NULL;
+        job->packed_len = 0;
+        job->sent = stat_start();
+        int offset = 0;
+        for (int r = 0; r < n; r++) {
+            Row *row = buffer_row(buffer, y + r);
+            row_flatten(row);
+            job->offsets[r] = offset;
+            memcpy(job->text + offset, row->chars, row->len);
+            offset += row->len;
+        }
+        job->offsets[n] = offset;
+
+        queue_push(&worker->to_thread, job);
+        buffer->jobs_sent[buffer->num_jobs_sent++] = job;
+        if (write(worker->wake_thread[1], "", 1) < 0) die("write");
+    }
+    return 1;
+}
+
+// Put a job's highlighting into the rows it still fits - a row that has been edited since it was sent, or
+// now starts in another state, is marked dirty again. Returns true if a row on screen changed.
+int highlight_worker_apply(TextBuffer *buffer, HighlightJob *job) {
+    int changed = 0;
+    for (int r = 0; r < job->num_rows; r++) {
+        int y = job->y + r;
+        if (y >= buffer->num_rows) break;
+        Row *row = buffer_row(buffer, y);
+        int state = y > 0 ? buffer_row(buffer, y - 1)->state : LEX_NORMAL;
+        if (state == LEX_UNKNOWN) state = LEX_NORMAL;
+        int len = job->offsets[r + 1] - job->offsets[r];
+        row_flatten(row);
+        if (state != (r ? job->states[r - 1] : job->start_state) || row->len != len ||
+            memcmp(row->chars, job->text + job->offsets[r], len) != 0) {
+            mark_dirty(buffer, y, y);
+            continue;
+        }
+
+        int old_state = row->state;
+        if (!row->remote) runs_store(&buffer->arena, row, job->packed + job->runs[r], (int)(job->runs[r + 1] - job->runs[r]));
+        row->state = job->states[r];
+        mark_changed(buffer, y, y);
+        if (y == buffer->hl_valid) buffer->hl_valid++;
+        if (y >= buffer->view_start && y < buffer->view_end) changed = 1;
+
+        // Carry on into the next row if the state it starts in has changed (just as highlight_syntax() does),
+        // unless that is for the catch-up pass to do
+        if (r == job->num_rows - 1 && row->state != old_state && y + 1 < buffer->hl_valid) {
+            buffer_row(buffer, y + 1)->remote = 0;
+            mark_dirty(buffer, y + 1, y + 1);
+        }
+    }
+    return changed;
+}
+
+// Re-highlight whatever the edits since the last call have marked dirty - on the highlight thread if it is
+// running and can take it
+void highlight_dirty(TextBuffer *buffer) {
+    if (buffer->dirty_start < 0) return;
+    if (!highlight_worker_send(buffer, buffer->dirty_start, buffer->dirty_end)) {
+        highlight_syntax(buffer, buffer->dirty_start, buffer->dirty_end);
+    }
+    buffer->dirty_start = -1;
+    buffer->dirty_end = -1;
+}
+
+// Take in whatever the highlight thread has sent back. Returns true if a row on screen changed.
+int highlight_worker_collect(TextBuffer *buffer) {
+    if (!buffer->num_jobs_sent) return 0;
+    char drain[64];
+    while (read(buffer->worker.wake[0], drain, sizeof(drain)) > 0) continue;
+
+    int changed = 0;
+    HighlightJob *job;
+    while ((job = queue_pop(&buffer->worker.from_thread))) {
+        for (int i = 0; i < buffer->num_jobs_sent; i++) {
+            if (buffer->jobs_sent[i] != job) continue;
+            buffer->jobs_sent[i] = buffer->jobs_sent[--buffer->num_jobs_sent];
+            break;
+        }
+        changed |= highlight_worker_apply(buffer, job);
+        stat_record(STAT_JOB, job->sent);
+        free(job->packed);
+        free(job);
+    }
+    // Send off anything that has to be done again, or carried on with
+    highlight_dirty(buffer);
+    return changed;
+}
+
+// Index the lines of the mapped file - each row is a view straight into the mapping until it is edited
+void map_rows(TextBuffer *buffer) {
+    char *p = buffer->map;
+    char *end = buffer->map + buffer->map_len;
+
+    // Count the lines first so the row array is allocated once
+    int lines = end[-1] == '\n' ? 0 : 1;
+    for (char *nl = p; (nl = memchr(nl, '\n', end - nl)); nl++) lines++;
+    buffer_reserve_rows(buffer, lines);
+
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        if (!nl) nl = end;
+        row_view(buffer_insert_row(buffer, buffer->num_rows), p, (int)(nl - p));
+        p = nl + 1;
+    }
+}
+
+// Everything loading does once the rows are in
+void load_finish(TextBuffer *buffer, const char *filename) {
+    // There is always at least one row to edit
+    if (buffer->num_rows == 0) {
+        row_init(&buffer->arena, buffer_insert_row(buffer, 0), "", 0);
+    }
+
+    // Highlighting is lazy - the screen is done on first paint and the rest in the background
+    if (!buffer->language) buffer->language = language_for_file(filename);
+    buffer->hl_valid = 0;
+    // Rows the cache has no use for are found in its table as they are reached, so it stands in for the
+    // parallel highlighting
+    if (buffer->cache_dir && buffer->filename[0]) cache_load(buffer);
+    if (!buffer->cache) prehighlight_start(buffer);
+}
+
+void load_file(TextBuffer *buffer, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            buffer->map_len = st.st_size;
+            buffer->map = mmap(NULL, buffer->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (buffer->map == MAP_FAILED) die("mmap");
+            map_rows(buffer);
+        }
+
+        close(fd);
+
+        snprintf(buffer->filename, sizeof(buffer->filename), "%s", filename);
+    }
+    load_finish(buffer, filename);
+}
+
+// Load a document from memory instead of a file - name is only used to choose the language, as a filename is
+void load_text(TextBuffer *buffer, const char *name, const char *text, size_t len) {
+    if (len > 0) {
+        // An anonymous mapping stands in for the file's, so the rows are views into it just the same
+        buffer->map_len = len;
+        buffer->map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer->map == MAP_FAILED) die("mmap");
+        memcpy(buffer->map, text, len);
+        map_rows(buffer);
+    }
+    snprintf(buffer->filename, sizeof(buffer->filename), "%s", name);
+    load_finish(buffer, name);
+}
+
+void *saver_thread(void *arg) {
+    Saver *saver = arg;
+    // The data must be on disk before the rename makes it the file, then the directory entry after it
+    if (fsync(saver->fd) != 0) saver->failed = "fsync";
+    if (close(saver->fd) != 0 && !saver->failed) saver->failed = "close";
+    if (!saver->failed && rename(saver->tmp_name, saver->filename) != 0) saver->failed = "rename";
+    if (saver->failed) {
+        saver->error = errno;
+        unlink(saver->tmp_name);
+    } else {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", saver->filename);
+        char *slash = strrchr(dir, '/');
+        if (slash) *(slash == dir ? slash + 1 : slash) = '\0';
+        else snprintf(dir, sizeof(dir), ".");
+        int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+    if (write(saver->wake[1], "", 1) < 0) return NULL;
+    return NULL;
+}
+
+// Wait for the save in progress, if there is one - buffer->saver.failed then says whether it worked.
+// Returns true if there was one.
+int save_finish(TextBuffer *buffer) {
+    Saver *saver = &buffer->saver;
+    if (!saver->running) return 0;
+    if (saver->threaded) pthread_join(saver->thread, NULL);
+    saver->running = 0;
+    close(saver->wake[0]);
+    close(saver->wake[1]);
+    return 1;
+}
+
+// Write n iovecs in full, however many writev() takes - returns -1 with errno set if it fails
+int write_iov(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t written = writev(fd, iov, n);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Add len bytes at p to the batch, extending the last iovec when they follow straight on from it - as
+// unedited rows and the newlines between them do in the mapping, so an unedited stretch of the file is
+// written in one piece straight from the page cache. Returns -1 if writing out a full batch fails.
+int save_gather(int fd, struct iovec *iov, int *n, const char *p, int len) {
+    if (len == 0) return 0;
+    if (*n > 0) {
+        struct iovec *last = &iov[*n - 1];
+        if ((char *)last->iov_base + last->iov_len == p && last->iov_len + len <= SAVE_IOV_BYTES) {
+            last->iov_len += len;
+            return 0;
+        }
+    }
+    if (*n == SAVE_IOVS) {
+        if (write_iov(fd, iov, *n) != 0) return -1;
+        *n = 0;
+    }
+    iov[(*n)++] = (struct iovec){(void *)p, len};
+    return 0;
+}
+
+// Write every row to fd - returns -1 with errno set if it fails
+int save_rows(TextBuffer *buffer, int fd) {
+    struct iovec iov[SAVE_IOVS]; // On the stack, so saves of different buffers never share it
+    int n = 0;
+    const char *map_end = buffer->map + buffer->map_len;
+    for (int i = 0; i < buffer->num_rows; i++) {
+        Row *row = buffer_row(buffer, i);
+        // Both sides of the gap, so saving never moves it
+        int tail = row->len - row->gap;
+        const char *end = row->chars + row->cap;
+        // Take the newline from the mapping when it is the one that came after the row there
+        const char *newline = row->store == ROW_MAPPED && end < map_end && *end == '\n' ? end : "\n";
+        if (save_gather(fd, iov, &n, row->chars, row->gap) != 0 || save_gather(fd, iov, &n, end - tail, tail) != 0 ||
+            save_gather(fd, iov, &n, newline, 1) != 0) {
+            return -1;
+        }
+    }
+    return write_iov(fd, iov, n);
+}
+
+// Saves to a temporary file that is then renamed over the original - the loaded file is still mapped
+// so it must never be truncated underneath the rows that are views into it. The rows are written here,
+// which is no more than copying them into the page cache; waiting for the disk is left to saver_thread().
+// A save that fails is reported through buffer->saver like one that fails there, leaving the original
+// file as it was.
+void save_file(TextBuffer *buffer, const char *filename) {
+    Saver *saver = &buffer->saver;
+    // Only one save at a time, so they land in order
+    save_finish(buffer);
+
+    // Through a symlink to the file it points at, so the rename replaces that rather than the link
+    char resolved[PATH_MAX];
+    if (realpath(filename, resolved)) filename = resolved;
+    snprintf(saver->filename, sizeof(saver->filename), "%s", filename);
+    snprintf(saver->tmp_name, sizeof(saver->tmp_name), "%s.XXXXXX", filename);
+    saver->failed = NULL;
+    saver->error = 0;
+    int fd = mkstemp(saver->tmp_name);
+    if (fd < 0) {
+        saver->failed = "mkstemp";
+        saver->error = errno;
+    } else {
+        // Keep the original's owner where that is allowed and its permissions (mkstemp creates the file
+        // 0600). Giving a file away needs privilege, so failing to is not a failed save, but then the
+        // set-id bits are not kept, as they would apply to the wrong owner.
+        struct stat st;
+        if (stat(filename, &st) == 0) {
+            int owned = (st.st_uid == getuid() && st.st_gid == getgid()) || fchown(fd, st.st_uid, st.st_gid) == 0;
+            fchmod(fd, st.st_mode & (owned ? 07777 : 0777));
+        } else {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0666 & ~mask);
+        }
+        if (save_rows(buffer, fd) != 0) {
+            saver->failed = "writev";
+            saver->error = errno;
+            close(fd);
+            unlink(saver->tmp_name);
+        }
+    }
+
+    saver->fd = fd;
+    if (pipe(saver->wake) != 0) die("pipe");
+    fcntl(saver->wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(saver->wake[1], F_SETFD, FD_CLOEXEC);
+    if (saver->failed) {
+        // Nothing for a thread to do, but the failure is reported when it is woken up as usual
+        saver->threaded = 0;
+        if (write(saver->wake[1], "", 1) < 0) saver->error = errno;
+    } else {
+        saver->threaded = pthread_create(&saver->thread, NULL, saver_thread, saver) == 0;
+        // No thread - wait for the disk here instead
+        if (!saver->threaded) saver_thread(saver);
+    }
+    saver->running = 1;
+}
+
+void free_buffer(TextBuffer *buffer) {
+    cache_save(buffer);
+    save_finish(buffer);
+    highlight_worker_stop(buffer);
+    prehighlight_stop(buffer);
+    for (int i = 0; i < buffer->num_rows; i++) {
+        row_free(&buffer->arena, buffer_row(buffer, i));
+    }
+    free(buffer->rows);
+    arena_free(&buffer->arena);
+    if (buffer->map) munmap(buffer->map, buffer->map_len);
+    if (buffer->cache) munmap(buffer->cache, buffer->cache_len);
+}
+
+void insert_char(TextBuffer *buffer, int x, int y, int c) {
+    long long start = stat_start();
+    Row *row = buffer_row(buffer, y);
+
+    if (x > row->len) x = row->len;
+
+    char ch = (char)c;
+    row_insert(&buffer->arena, row, x, &ch, 1);
+    row->remote = 0;
+    mark_dirty(buffer, y, y);
+    stat_record(STAT_EDIT, start);
+}
+
+void delete_char(TextBuffer *buffer, int x, int y) {
+    Row *row = buffer_row(buffer, y);
+
+    if (x <= 0 || x > row->len) return;
+
+    long long start = stat_start();
+    row_delete(&buffer->arena, row, x - 1, 1);
+    row->remote = 0;
+    mark_dirty(buffer, y, y);
+    stat_record(STAT_EDIT, start);
+}
+
+// Split row y at x, without marking anything dirty
+void row_split(TextBuffer *buffer, int x, int y) {
+    Row *new_row = buffer_insert_row(buffer, y + 1);
+    Row *row = buffer_row(buffer, y);
+
+    if (x > row->len) x = row->len;
+
+    // With the gap at x the tail of the row is contiguous at the far end of the gap
+    row_move_gap(row, x);
+    int tail = row->cap - (row->len - x);
+    if (row->store == ROW_MAPPED) {
+        // A view splits into two views, with no copying
+        row_view(new_row, row->chars + tail, row->len - x);
+        row->cap = x;
+    } else {
+        row_init(&buffer->arena, new_row, row->chars + tail, row->len - x);
+    }
+    runs_split(&buffer->arena, row, new_row, x);
+    // The end of the row is now the end of the new row, so re-highlighting can stop there if nothing changed
+    new_row->state = row->state;
+    row->len = x;
+    row->remote = 0;
+}
+
+// Join row y onto the end of row y - 1, without marking anything dirty, and return where the join is
+int row_join(TextBuffer *buffer, int y) {
+    Row *prev = buffer_row(buffer, y - 1);
+    Row *row = buffer_row(buffer, y);
+    int prev_len = prev->len;
+
+    row_flatten(row);
+    row_insert(&buffer->arena, prev, prev_len, row->chars, row->len);
+    runs_append(&buffer->arena, prev, row, prev_len);
+    // The next row carries on from the state row y ended in
+    prev->state = row->state;
+    prev->remote = 0;
+    buffer_delete_row(buffer, y);
+    return prev_len;
+}
+
+// Split row y at x, the text after x becoming a new row y + 1
+void split_row(TextBuffer *buffer, int x, int y) {
+    long long start = stat_start();
+    row_split(buffer, x, y);
+    mark_dirty(buffer, y, y + 1);
+    stat_record(STAT_EDIT, start);
+}
+
+// Join row y onto the end of row y - 1, returning where the join is
+int join_rows(TextBuffer *buffer, int y) {
+    long long start = stat_start();
+    int x = row_join(buffer, y);
+    mark_dirty(buffer, y - 1, y - 1);
+    stat_record(STAT_EDIT, start);
+    return x;
+}
+
+// Insert len characters of text at *x, *y, with a new row for each newline in it, and move *x, *y to the end
+// of what was inserted. The rows in between are made in one pass, whatever the size of the text.
+void insert_text(TextBuffer *buffer, int *x, int *y, const char *text, size_t len) {
+    long long start = stat_start();
+    Row *row = buffer_row(buffer, *y);
+    if (*x > row->len) *x = row->len;
+    int first = *y;
+
+    const char *nl = memchr(text, '\n', len);
+    if (nl) {
+        int lines = 1;
+        for (const char *p = nl + 1; (p = memchr(p, '\n', text + len - p)); p++) lines++;
+        buffer_reserve_rows(buffer, buffer->num_rows + lines + BUFFER_MIN_GAP);
+
+        // The text after x goes after the last line, and the first line goes on the end of what is left
+        row_split(buffer, *x, *y);
+        row = buffer_row(buffer, *y);
+        row_insert(&buffer->arena, row, *x, text, (int)(nl - text));
+        row->remote = 0;
+        const char *p = nl + 1;
+        for (; (nl = memchr(p, '\n', text + len - p)); p = nl + 1) {
+            row_init(&buffer->arena, buffer_insert_row(buffer, ++*y), p, (int)(nl - p));
+        }
+        // What follows the last newline starts the row holding the rest
+        len = text + len - p;
+        text = p;
+        *x = 0;
+        ++*y;
+        row = buffer_row(buffer, *y);
+    }
+    if (len > 0) {
+        row_insert(&buffer->arena, row, *x, text, (int)len);
+        row->remote = 0;
+        *x += (int)len;
+    }
+
+    mark_dirty(buffer, first, *y);
+    stat_record(STAT_EDIT, start);
+}
+
+// Delete the text from x1, y1 up to x2, y2 - any rows in between go, and what is left of row y2 is joined
+// onto row y1
+void delete_text(TextBuffer *buffer, int x1, int y1, int x2, int y2) {
+    long long start = stat_start();
+    if (y2 >= buffer->num_rows) {
+        y2 = buffer->num_rows - 1;
+        x2 = INT_MAX;
+    }
+    Row *row = buffer_row(buffer, y1);
+    if (x1 > row->len) x1 = row->len;
+    if (y1 == y2) {
+        if (x2 > row->len) x2 = row->len;
+        if (x2 <= x1) {
+            // Nothing to delete, but it is still an edit for the histogram
+            stat_record(STAT_EDIT, start);
+            return;
+        }
+        row_delete(&buffer->arena, row, x1, x2 - x1);
+        row->remote = 0;
+    } else if (y2 > y1) {
+        Row *last = buffer_row(buffer, y2);
+        if (x2 > last->len) x2 = last->len;
+        if (x2 > 0) row_delete(&buffer->arena, last, 0, x2);
+        if (row->len > x1) row_delete(&buffer->arena, row, x1, row->len - x1);
+        // From the bottom up, so the row array's gap only moves one row at a time
+        for (int y = y2 - 1; y > y1; y--) buffer_delete_row(buffer, y);
+        row_join(buffer, y1 + 1);
+    }
+    mark_dirty(buffer, y1, y1);
+    stat_record(STAT_EDIT, start);
+}
@@ -0,0 +1,357 @@
+//
+// libsdslh - the toy editor's text buffer and built-in highlighting, with no terminal or highlighter process
+// in it, for embedding wherever highlighting has to be in-process. A TextBuffer holds a document and the
+// threads working on it; edit it with insert_char(), delete_char(), split_row() and join_rows(), then
+// highlight_dirty() and highlight_worker_collect() keep its colours up to date, which row_colours() reads.
+//
+#ifndef SDSLH_H
+#define SDSLH_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define HIGHLIGHT_CHUNK 1000 // Rows highlighted per background catch-up step
+#define PREHIGHLIGHT_CHUNK (1 << 20) // Bytes of a loaded file each parallel highlighting task covers
+#define PREHIGHLIGHT_MAX_THREADS 64
+#define HIGHLIGHT_QUEUE 64 // Jobs that can be out with the highlight thread at once - a power of two
+#define HIGHLIGHT_JOB_ROWS 256 // Most rows sent to the highlight thread in one job
+#define SAVE_IOVS 1024 // Pieces gathered into each writev() when saving - IOV_MAX on Linux
+#define SAVE_IOV_BYTES (1 << 30) // Largest piece, well inside what one writev() can take
+#define ROW_MIN_GAP 16 // Smallest gap opened in a row when it has to grow
+#define BUFFER_MIN_GAP 64 // Smallest gap opened in the row array when it has to grow
+#define SLAB_SIZE (1 << 20) // Row storage is carved out of slabs this big
+#define POOL_MIN 32 // Smallest recycled block for a row that has grown
+#define POOL_CLASSES 8 // Recycled block sizes POOL_MIN, 2 * POOL_MIN, ... - bigger rows use malloc
+#define CACHE_MAGIC "SDSLHC1" // Starts a highlighting cache file
+#define CACHE_FORMAT 2 // Bump whenever the cache layout, or what the built-in highlighters make of a row, changes
+
+// Colour pairs
+#define PAIR_HEADER 1
+#define PAIR_FOOTER 2
+#define PAIR_BODY 3
+#define PAIR_COMMENT 4
+#define PAIR_KEYWORD 5
+#define PAIR_STRING 6
+#define PAIR_NUM 7
+#define PAIR_OPERATOR 8
+#define PAIR_VARIABLE 9
+#define PAIR_ERROR 10
+
+// Lexer states - the highlighter's state at the end of a row, carried into the start of the next row.
+// Each language numbers its own states, apart from these two.
+#define LEX_NORMAL 0
+#define LEX_UNKNOWN 0xFF // Row has never been highlighted, never matches a real state
+// States of highlight_default()
+#define LEX_STRING 1 // Inside a "string", which may carry on over several lines
+#define LEX_COMMENT 2 // Inside a /* block comment */
+#define DFA_START 1 // Start state of a generated lexer - state 0 ends a token
+
+// Where a row's storage came from
+#define ROW_SLAB 0 // Exact-sized, carved from a slab - only released with the whole arena
+#define ROW_POOL 1 // Power-of-two sized, carved from a slab and recycled through the pool free lists
+#define ROW_HEAP 2 // Too big for the pool, malloc'd
+#define ROW_MAPPED 3 // A read-only view into the loaded file's mapping (or, for runs, the cache's), copied out on first edit
+
+// A stretch of a row's characters in one PAIR_* colour
+typedef struct {
+    int start;
+    int len;
+    int pair;
+} Run;
+
+// A row of text is a gap buffer - the characters are chars[0..gap) followed by chars[gap + cap - len..cap),
+// so typing at the same place only moves the gap once and growth is geometric.
+// Its syntax highlighting is a list of runs in column order that never overlap, packed a couple of bytes
+// to a run (see runs_pack()). Characters no run covers are PAIR_BODY, so whitespace, plain text and rows
+// never highlighted cost nothing.
+typedef struct {
+    char *chars;
+    unsigned char *runs;
+    int len; // Number of characters, not counting the gap
+    int cap; // Allocated size of chars, including the gap
+    int gap; // Where the gap starts
+    int run_len; // Bytes of packed runs
+    int run_cap; // Allocated size of runs
+    unsigned char state; // Lexer state at the end of the row (LEX_*)
+    unsigned char store; // Where chars came from (ROW_*)
+    unsigned char run_store; // Where runs came from (ROW_*)
+    unsigned char remote; // Colours came from the highlighter process and the row has not been edited since
+} Row;
+
+// A slab of row storage, handed out by bumping used
+typedef struct Slab {
+    struct Slab *next;
+    size_t used;
+    size_t size;
+    char data[];
+} Slab;
+
+// All the text and syntax runs of a buffer live in its arena so it can be released in one go
+typedef struct {
+    Slab *slabs; // Current slab first
+    void *free_list[POOL_CLASSES]; // Released pool blocks, linked through their first bytes
+} Arena;
+
+// A table-driven lexer, generated by lexgen from a languages/*.lex rule file
+typedef struct {
+    const unsigned char *classes; // Column of next for each byte
+    const unsigned char *next; // Next state by state and column, 0 where the token ends
+    int columns;
+    const unsigned char *pairs; // Colour of a token that stops in each state
+    const unsigned char *carry; // State the next row starts in when a row ends in each state, LEX_NORMAL for none
+    // Keywords, in a minimal perfect hash - see keyword_pair()
+    const unsigned char *keyword_states; // Tokens that stop in these states may be keywords
+    const unsigned *displace; // By bucket
+    int buckets;
+    const char *const *keywords; // By slot
+    const unsigned char *keyword_pairs; // By slot
+    int num_keywords;
+    int keyword_max; // Length of the longest keyword
+    int fold; // Keywords match in any case
+} Dfa;
+
+// A built-in highlighter - highlight colours len characters starting in the given lexer state, one
+// PAIR_* byte per character, and returns the state at the end
+typedef struct Language {
+    const char *name;
+    const char *extensions; // Space separated, each with its dot
+    int (*highlight)(const struct Language *language, const char *chars, int len, int state, char *syntax);
+    Dfa dfa; // Tables for highlight_dfa()
+    unsigned long long version; // Hash of the rule file, so highlighting cached by another build is not used
+    int num_states; // Rows start and end in states below this
+} Language;
+
+// Rows copied out for the highlight thread, which sends the job back with their highlighting filled in
+typedef struct {
+    int y; // First row - moved along as rows are inserted and deleted above it, never read by the thread
+    int num_rows;
+    unsigned char start_state; // State the first row starts in
+    int *offsets; // Where each row's text starts in text, num_rows + 1 of them
+    char *text;
+    // Filled in by the highlight thread
+    unsigned char *states; // End state of each row
+    unsigned *runs; // Where each row's packed runs start in packed, num_rows + 1 of them
+    unsigned char *packed;
+    size_t packed_len;
+    long long sent; // stat_start() when it was sent
+} HighlightJob;
+
+// Latency instrumentation, turned on by setting stats.enabled (te -t). Each phase's times go into a histogram
+// with 16 buckets per power of two of nanoseconds, so any percentile is known to within about 6% however long the run.
+#define STAT_KEY 0 // A key arriving to the screen showing what it did
+#define STAT_EDIT 1 // insert_char(), delete_char(), split_row() and join_rows()
+#define STAT_HIGHLIGHT 2 // highlight_syntax() on this thread
+#define STAT_JOB 3 // Rows sent to the highlight thread to their result being applied
+#define STAT_RENDER 4 // editor_refresh()
+#define STAT_HIGHLIGHTER 5 // A HIGHLIGHT request to the highlighter process to its reply
+#define STAT_COUNT 6
+#define STAT_SUB_BITS 4
+#define STAT_BUCKETS ((64 - STAT_SUB_BITS) << STAT_SUB_BITS)
+
+extern const char *const STAT_NAMES[STAT_COUNT];
+
+typedef struct {
+    long long count;
+    long long max;
+    long long buckets[STAT_BUCKETS];
+} Histogram;
+
+typedef struct {
+    int enabled;
+    Histogram histograms[STAT_COUNT];
+} Stats;
+
+extern Stats stats; // For the whole process, as it times whatever is done on any buffer
+
+// A row as a parallel highlighting thread found it
+typedef struct {
+    unsigned offset; // From the start of its chunk
+    int len;
+    unsigned runs; // Where its packed runs start in the chunk's runs - they end where the next row's start
+    unsigned char start_state; // The state it was highlighted from
+    unsigned char state; // And the state it ended in
+} PreRow;
+
+// A stretch of whole lines of the mapped file for one thread to highlight
+typedef struct {
+    size_t start;
+    size_t end;
+    PreRow *rows;
+    int num_rows;
+    unsigned char *runs;
+    size_t runs_len;
+    atomic_int done;
+} PreChunk;
+
+// Parallel highlighting of a freshly loaded file. Threads highlight chunks of the mapped file straight into
+// chunk-private runs, each chunk starting from LEX_NORMAL, while the catch-up pass copies their work into the
+// rows in order. A row that has been edited, or that starts in another state than its thread guessed (a
+// chunk that really starts inside a comment), is highlighted by the catch-up pass itself - that carries on
+// until the states agree again, which stitches the chunks together.
+typedef struct {
+    int running;
+    PreChunk *chunks;
+    int num_chunks;
+    atomic_int next_chunk;
+    atomic_int stop;
+    pthread_t threads[PREHIGHLIGHT_MAX_THREADS];
+    int num_threads;
+    int wake[2]; // A byte is written when a chunk is done, to wake the input loop
+    int waiting; // The catch-up pass has caught up with the threads
+} Prehighlight;
+
+// Lock-free ring of jobs with one thread pushing and one popping
+typedef struct {
+    HighlightJob *jobs[HIGHLIGHT_QUEUE];
+    atomic_uint head; // Next to pop - only moved by the popping thread
+    atomic_uint tail; // Next to push - only moved by the pushing thread
+} JobQueue;
+
+// Re-highlighting after edits runs on its own thread, so however slow a language is to highlight the input
+// loop never waits for it. Only this thread touches ncurses and the rows - the highlight thread only sees
+// copies of the rows' text, and its results are checked against the rows as they are by the time they come
+// back, as the rows may have been edited again meanwhile.
+typedef struct {
+    const Language *language;
+    JobQueue to_thread;
+    JobQueue from_thread;
+    pthread_t thread;
+    int running;
+    atomic_int stop;
+    int wake_thread[2]; // A byte per job sent
+    int wake[2]; // A byte per job sent back, to wake the input loop
+} HighlightWorker;
+
+// Highlighting cached between runs, in a file per loaded file in the cache directory that is mapped as it
+// is: a CacheHeader, a CacheRow for each row, a hash table of the rows by text and start state, then the
+// rows' packed runs. A row highlights the same wherever it is, given the state it starts in, so rows of a
+// file that has changed since are found in the table - only new and changed rows, and rows a change has
+// given a new start state, are highlighted again.
+typedef struct {
+    char magic[8]; // CACHE_MAGIC
+    unsigned long long version; // cache_version() of the language that made it
+    unsigned num_rows;
+    unsigned num_slots; // Entries in the hash table - a power of two, at least twice the rows in it
+    unsigned long long runs_len;
+    char path[PATH_MAX]; // The file it is for, made absolute
+} CacheHeader;
+
+typedef struct {
+    unsigned long long hash; // row_hash() of its text
+    unsigned runs; // Where its packed runs start, from the start of the runs
+    unsigned run_len;
+    unsigned len; // Characters in the row
+    unsigned char start_state;
+    unsigned char state;
+    unsigned char valid; // 0 for a row coloured by the highlighter process, whose runs are not the built-in ones
+} CacheRow;
+
+// A save in progress - the rows have all been written by the time it gets here, and its thread flushes them
+// to disk and renames the temporary file over the original, so neither holds up the input loop
+typedef struct {
+    pthread_t thread;
+    int running;
+    int threaded; // Has a thread to join - otherwise it was all done in save_file()
+    int fd;
+    char tmp_name[PATH_MAX + sizeof(".XXXXXX")];
+    char filename[PATH_MAX];
+    int error; // errno of the step that failed, 0 if the save worked
+    const char *failed; // Which step that was
+    int wake[2]; // Written to when the thread is done
+} Saver;
+
+// A document and everything working on it - the library keeps no other state, so any number of them can
+// be open at once. Zero it, set dirty_start and dirty_end to -1 (and language, threads and cache_dir if
+// wanted), then load_file() or load_text().
+//
+// Whoever needs to know what has changed since they last looked (say to send only that on) sets
+// changed_start to -1, and from then on edits and highlighting widen the changed range to cover every row
+// whose text or colours they touch. Rows before it are as they were, and rows after it are the same rows as
+// before, changed_rows further on. Left zeroed it counts row 0 as changed, which is always safe.
+typedef struct {
+    int num_rows;
+    Row *rows; // Gap buffer of rows - rows[0..row_gap) then the gap, then the rest of the rows up to row_cap
+    int row_cap;
+    int row_gap;
+    int dirty_start; // First row needing re-highlighting, -1 if nothing is dirty
+    int dirty_end; // Last row needing re-highlighting (inclusive)
+    int hl_valid; // Rows before this have been highlighted in order from the top - the rest may only be provisional
+    Arena arena;
+    char *map; // The loaded file, mapped read-only
+    size_t map_len;
+    const Language *language; // Chosen by the file extension unless set before load_file()
+    char filename[PATH_MAX]; // As loaded
+    int threads; // Used to highlight the file on load - 0 for one per CPU, 1 to leave it all to catch-up
+    const char *cache_dir; // Where highlighting is cached between runs, NULL for nowhere
+    char *cache; // The file's cache, mapped read-only - rows' runs may point into it
+    size_t cache_len;
+    int view_start; // Rows on screen, view_start..view_end (exclusive) - set by whoever draws them
+    int view_end;
+    Prehighlight prehighlight;
+    HighlightWorker worker;
+    HighlightJob *jobs_sent[HIGHLIGHT_QUEUE]; // Out with the highlight thread
+    int num_jobs_sent;
+    Saver saver;
+    int changed_start; // First row changed, -1 if none have
+    int changed_end; // Last row changed (inclusive) - may be changed_start - 1 if rows were only deleted
+    int changed_rows; // Rows inserted less rows deleted
+} TextBuffer;
+
+// Errors the library cannot carry on from end the process - this is called first, if set, to put the
+// terminal (or whatever else) back
+extern void (*die_cleanup)(void);
+void die(const char *s);
+
+long long now_ns(void);
+long long stat_start(void);
+void stat_record(int stat, long long start);
+void histogram_record(Histogram *histogram, long long ns);
+long long stat_percentile(const Histogram *histogram, double percent);
+void stats_dump(FILE *fp);
+
+const Language *language_named(const char *name);
+const Language *language_for_file(const char *filename);
+
+// Rows and their colours
+Row *buffer_row(TextBuffer *buffer, int y);
+void row_flatten(Row *row);
+void row_colours(Row *row, int x, char *syntax, int len);
+void row_paint(Arena *arena, Row *row, int x, int n, int pair);
+const unsigned char *unpack_run(const unsigned char *p, Run *run, int last_end);
+
+// Loading, saving and editing
+void load_file(TextBuffer *buffer, const char *filename);
+void load_text(TextBuffer *buffer, const char *name, const char *text, size_t len);
+void save_file(TextBuffer *buffer, const char *filename);
+int save_finish(TextBuffer *buffer);
+void free_buffer(TextBuffer *buffer);
+void insert_char(TextBuffer *buffer, int x, int y, int c);
+void delete_char(TextBuffer *buffer, int x, int y);
+void split_row(TextBuffer *buffer, int x, int y);
+int join_rows(TextBuffer *buffer, int y);
+void insert_text(TextBuffer *buffer, int *x, int *y, const char *text, size_t len);
+void delete_text(TextBuffer *buffer, int x1, int y1, int x2, int y2);
+void mark_dirty(TextBuffer *buffer, int start, int end);
+void mark_changed(TextBuffer *buffer, int start, int end);
+
+// Highlighting cache
+unsigned long long row_hash(const char *chars, int len);
+void cache_path(const char *cache_dir, const char *filename, char *path, size_t size);
+void cache_save(TextBuffer *buffer);
+
+// Highlighting
+int highlight_default(const Language *language, const char *chars, int len, int state, char *syntax);
+int highlight_row(TextBuffer *buffer, Row *line, int state);
+void highlight_syntax(TextBuffer *buffer, int start, int end);
+void highlight_visible(TextBuffer *buffer, int start, int end);
+int highlight_catch_up(TextBuffer *buffer, int max_rows);
+void highlight_worker_start(TextBuffer *buffer);
+void highlight_worker_stop(TextBuffer *buffer);
+void highlight_dirty(TextBuffer *buffer);
+int highlight_worker_collect(TextBuffer *buffer);
+void scratch_free(void);
+
+#endif // SDSLH_H